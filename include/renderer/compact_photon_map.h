@@ -0,0 +1,37 @@
+#pragma once
+#include "camera.h"
+#include "photon_kdtree.h"
+#include <vector>
+
+// Jensen-style compressed photon: float position, RGBE shared-exponent power,
+// quantized spherical incoming direction and the kd split axis.
+struct CompactPhoton
+{
+    Vec3 position;
+    unsigned char power[4]; // r, g, b mantissas + shared exponent
+    unsigned char theta;    // polar angle from +z, 256 steps over [0, pi]
+    unsigned char phi;      // azimuth, 256 steps over [0, 2pi)
+    unsigned char axis;
+    unsigned char flags;
+
+    void setPower(const Vec3 &p);
+    Vec3 decodePower() const;
+    void setDirection(const Vec3 &d);
+    Vec3 decodeDirection() const;
+};
+
+static_assert(sizeof(CompactPhoton) == 20, "CompactPhoton should stay at 20 bytes");
+
+using CompactPhotonHeap = BasicPhotonHeap<CompactPhoton>;
+
+// Same store/balance/locate workflow as PhotonMap at half the memory per photon.
+class CompactPhotonMap {
+public:
+    std::vector<CompactPhoton> photons;
+
+    void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir);
+    void balance();
+    void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                       CompactPhotonHeap &heap) const;
+    size_t size() const { return photons.size(); }
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+
+// Counter-based random numbers: draw n of stream s is a hash of (seed, s, n),
+// so each photon gets its own reproducible stream no matter which thread
+// traces it or in what order. Satisfies UniformRandomBitGenerator, so it
+// works with the <random> distributions.
+class CounterRng
+{
+public:
+    using result_type = uint32_t;
+
+    CounterRng(uint64_t seed, uint64_t stream) : key(mix(mix(seed) ^ (stream * GOLDEN + GOLDEN))) {}
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    result_type operator()() { return (result_type)(mix(key + GOLDEN * ++counter) >> 32); }
+
+private:
+    static constexpr uint64_t GOLDEN = 0x9E3779B97F4A7C15ull;
+
+    // SplitMix64 finalizer.
+    static uint64_t mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t key;
+    uint64_t counter = 0;
+};
@@ -0,0 +1,17 @@
+#pragma once
+#include "photon_map.h"
+#include "photon_hash_grid.h"
+#include "photon_incremental.h"
+#include "photon_out_of_core.h"
+#include "photon_surface.h"
+#include <memory>
+#include <string>
+
+// gatherRadius sizes the grid cells of backends that use one. Out-of-core maps
+// keep their files in spillDirectory and cache at most cacheBytes of photons.
+std::unique_ptr<PhotonMapBackend> createPhotonMap(PhotonBackendType type, float gatherRadius,
+                                                  const std::string &spillDirectory = ".",
+                                                  size_t cacheBytes = OUT_OF_CORE_DEFAULT_CACHE_BYTES);
+// Accepts "kdtree", "grid", "incremental", "outofcore" or "surface"; returns
+// false for anything else.
+bool parsePhotonBackendType(const std::string &name, PhotonBackendType &type);
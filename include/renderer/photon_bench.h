@@ -0,0 +1,18 @@
+#pragma once
+
+// Compares the heap-order and van Emde Boas kd-tree layouts on synthetic
+// photon maps of 30k, 1M and 10M photons and prints a table. Returns the
+// process exit code.
+int runLayoutBenchmark();
+
+// Traces the Cornell box photon maps and, for a range of epsilons, compares
+// (1+epsilon)-approximate lookups against exact ones: time per query, gather
+// radius, photons shared with the exact result, and the error of the density
+// estimate sum(power) / (pi r^2). Returns the process exit code.
+int runApproximationBenchmark();
+
+// Copies the traced Cornell box maps into CompactPhotonMaps and compares the
+// two formats: bytes per photon, time per query, and the error the quantized
+// power and direction add to the density estimate. Returns the process exit
+// code.
+int runCompactBenchmark();
@@ -0,0 +1,45 @@
+#pragma once
+#include "camera.h"
+#include "photon_kdtree.h"
+#include <vector>
+#include <cstdint>
+
+struct Photon;
+
+// Leaves hold at most this many photons; median splits leave 8-16 per leaf.
+const int PHOTON_BUCKET_SIZE = 16;
+// Leaf slots are padded to a multiple of the widest SIMD width we use.
+const int PHOTON_BUCKET_LANES = 8;
+
+// Bucketed kd-tree over an already balanced photon array. Leaves store their
+// photon positions as structure-of-arrays so one SIMD pass can compute every
+// squared distance in the leaf. Photons are referenced by index, so the owning
+// PhotonMap passes its array back in at query time.
+class PhotonBucketTree
+{
+public:
+    void build(const std::vector<Photon> &photons);
+    void clear();
+    bool empty() const { return nodes.empty(); }
+
+    void locatePhotons(const Photon *photons, const Vec3 &pos, int maxPhotons,
+                       float &maxDistSq, BasicPhotonHeap<Photon> &heap,
+                       float farScaleSq = 1.0f, PhotonQueryStats *stats = nullptr) const;
+
+private:
+    struct Node
+    {
+        float split;
+        int axis;            // -1 for leaves
+        uint32_t rightChild; // inner nodes; the left child is always index + 1
+        uint32_t first;      // leaves: first slot in the SoA arrays
+        uint32_t count;      // leaves: number of real photons
+    };
+
+    std::vector<Node> nodes;
+    std::vector<float> xs, ys, zs;
+    std::vector<uint32_t> photonIndex;
+
+    uint32_t buildNode(const std::vector<Photon> &photons, std::vector<uint32_t> &indices,
+                       size_t start, size_t end);
+};
@@ -0,0 +1,8 @@
+#pragma once
+#include "camera.h"
+
+// Unit vectors quantized to two bytes, as in Jensen's compact photon: theta is
+// the polar angle from +z in 256 steps over [0, pi], phi the azimuth in 256
+// steps over [0, 2pi).
+void encodePhotonDirection(const Vec3 &d, unsigned char &theta, unsigned char &phi);
+Vec3 decodePhotonDirection(unsigned char theta, unsigned char phi);
@@ -0,0 +1,36 @@
+#pragma once
+#include "photon_map.h"
+#include <vector>
+#include <cstdint>
+
+// Uniform hashed grid backend. balance() counting-sorts the photons by cell in
+// O(n); a lookup only visits the cells overlapping the gather sphere, so the
+// cell size should match the gather radius used with this map.
+class PhotonHashGrid : public PhotonMapBackend {
+public:
+    // Sorted by cell once balance() has run.
+    std::vector<Photon> photons;
+
+    explicit PhotonHashGrid(float cellSize);
+
+    PhotonBackendType type() const override { return PhotonBackendType::HashGrid; }
+    const char *name() const override { return "hash grid"; }
+    void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+               const Vec3 &normal, int primitive) override;
+    void scalePower(float factor) override;
+    void balance() override;
+    void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                       PhotonHeap &heap) const override;
+    size_t size() const override { return photons.size(); }
+    const Photon *photonData() const override { return photons.data(); }
+
+private:
+    float cellSize;
+    float invCellSize;
+    uint32_t tableMask = 0;
+    // Photons of hash bucket h are photons[cellStart[h] .. cellStart[h + 1]).
+    std::vector<uint32_t> cellStart;
+
+    int cellCoord(float x) const;
+    uint32_t cellHash(int x, int y, int z) const;
+};
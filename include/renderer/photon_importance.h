@@ -0,0 +1,42 @@
+#pragma once
+#include <vector>
+#include "renderer/camera.h"
+#include "renderer/photon_stream.h"
+
+// The light is split into this many patches per side.
+const int IMPORTANCE_MAP_PATCHES = 4;
+// Cells per side of each patch's direction grid.
+const int IMPORTANCE_MAP_RESOLUTION = 16;
+// Share of the photons still emitted uniformly, so that directions no
+// importon found keep being sampled and the estimate stays unbiased.
+const float IMPORTANCE_MAP_UNIFORM_SHARE = 0.5f;
+
+// Emission distribution for a downward-facing rectangular area light,
+// learned from importons: bins of (light patch, direction cell), the cells
+// laid out like PhotonProjectionMap's so that each carries the same share of
+// a uniform emission. Importance deposited into a bin raises the chance of
+// emitting through it; sample() returns the power weight that makes up for it.
+class PhotonImportanceMap
+{
+public:
+    PhotonImportanceMap(const Vec3 &lightCenter, float halfWidth, float halfDepth);
+
+    // Importance of photons leaving the light at `origin` along `direction`.
+    void deposit(const Vec3 &origin, const Vec3 &direction, float importance);
+    // Builds the emission distribution from the deposits so far.
+    void finalize();
+
+    // Emission drawn from the distribution. `weight` is the uniform emission
+    // density over this one, the factor that keeps the photon's power unbiased.
+    void sample(PhotonSampler &sampler, Vec3 &origin, Vec3 &direction, float &weight) const;
+
+    // Fewest bins holding `fraction` of the deposited importance, and all bins.
+    int binsHolding(float fraction) const;
+    int binCount() const { return (int)importance.size(); }
+
+private:
+    Vec3 corner;
+    float patchWidth, patchDepth;
+    std::vector<double> importance;
+    std::vector<double> cdf;
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include "photon_map.h"
+#include <vector>
+
+// Photons stored since the last level was built are scanned linearly; once
+// there are this many they become a balanced level of their own.
+const size_t INCREMENTAL_BASE_LEVEL = 4096;
+
+// Log-structured backend for progressive refinement. Photons live in one
+// array as a run of independently balanced kd-tree levels, largest first,
+// followed by a short unbalanced tail. A new level is merged with the levels
+// before it while they are no larger than it, so sizes at least double
+// towards the front, there are O(log n) levels, and each photon is rebalanced
+// O(log n) times in total. Stored photons are queryable immediately.
+class IncrementalPhotonMap : public PhotonMapBackend {
+public:
+    std::vector<Photon> photons;
+
+    PhotonBackendType type() const override { return PhotonBackendType::Incremental; }
+    const char *name() const override { return "incremental kd-tree"; }
+    void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+               const Vec3 &normal, int primitive) override;
+    void scalePower(float factor) override;
+    // Turns the unbalanced tail into a level; never rebuilds balanced levels
+    // except through the geometric merge.
+    void balance() override;
+    void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                       PhotonHeap &heap) const override;
+    size_t size() const override { return photons.size(); }
+    const Photon *photonData() const override { return photons.data(); }
+
+    size_t levelCount() const { return levels.size(); }
+
+private:
+    struct Level
+    {
+        size_t start;
+        size_t count;
+    };
+
+    // Balanced levels cover photons[0, tailStart).
+    std::vector<Level> levels;
+    size_t tailStart = 0;
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include "camera.h"
+#include "photon_kdtree.h"
+#include <vector>
+#include <atomic>
+
+struct Photon;
+class PhotonMapBackend;
+
+// Every this many photons of a map gets a precomputed irradiance estimate.
+const int IRRADIANCE_PHOTON_STRIDE = 4;
+// Irradiance photons only answer for surfaces whose normal is this close.
+const float IRRADIANCE_NORMAL_COS = 0.9f;
+
+struct IrradiancePhoton
+{
+    Vec3 position;
+    Vec3 irradiance;
+    short axis;
+    unsigned char normalTheta, normalPhi;
+};
+
+// Christensen's irradiance photons: irradiance is estimated once at a subset
+// of the photon positions, so a diffuse lookup becomes one nearest-neighbour
+// search instead of a k-photon gather and BRDF loop.
+class IrradiancePhotonMap
+{
+public:
+    // Estimates irradiance at every `stride`-th of the `count` photons with a
+    // k-NN gather against `map`, which must already be balanced. Builds
+    // nothing once *cancel is set.
+    void build(const PhotonMapBackend &map, const Photon *photons, size_t count, int stride,
+               float initialRadius, const std::atomic<bool> *cancel = nullptr);
+    void clear() { photons.clear(); }
+    bool empty() const { return photons.empty(); }
+    size_t size() const { return photons.size(); }
+
+    // Irradiance of the nearest precomputed photon within sqrt(maxDistSq)
+    // whose surface normal agrees with `normal`; false if there is none.
+    // Traversal counters go to `stats` in PHOTON_STATS builds.
+    bool lookup(const Vec3 &pos, const Vec3 &normal, float maxDistSq, Vec3 &irradiance,
+                PhotonQueryStats *stats = nullptr) const;
+    // kd-tree nodes the same lookup visits; it runs again just to count them.
+    uint32_t lookupNodes(const Vec3 &pos, const Vec3 &normal, float maxDistSq) const;
+
+private:
+    std::vector<IrradiancePhoton> photons;
+};
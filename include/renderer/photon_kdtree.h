@@ -0,0 +1,362 @@
+#pragma once
+#include "camera.h"
+#include "photon_stats.h"
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+// Left-balanced kd-tree algorithms shared by every photon record type. A
+// record needs a Vec3 `position` and an integral `axis` member; the tree is
+// stored implicitly with the children of node i at 2i+1 and 2i+2.
+
+const int MAX_GATHER_PHOTONS = 50;
+// Deep enough for any left-balanced tree addressable with size_t indices.
+const int PHOTON_STACK_DEPTH = 64;
+
+// Segments at least this large split into independent OpenMP tasks.
+const size_t BALANCE_TASK_CUTOFF = 1 << 14;
+// Segments at least this large scan their bounding box in parallel chunks.
+const size_t BALANCE_PARALLEL_BBOX_CUTOFF = 1 << 18;
+const int BALANCE_BBOX_CHUNKS = 16;
+
+// Fixed-capacity max-heap of the nearest photons found so far. It is owned by
+// the caller (typically on the stack), so a lookup never touches the allocator.
+template <typename P>
+struct BasicPhotonHeap
+{
+    struct Entry
+    {
+        float distSq;
+        const P *photon;
+        bool operator<(const Entry &other) const
+        {
+            return distSq < other.distSq;
+        }
+    };
+
+    Entry entries[MAX_GATHER_PHOTONS];
+    int count = 0;
+#ifdef PHOTON_STATS
+    // Activity since construction or the last clear().
+    uint32_t pushes = 0;
+    uint32_t pops = 0;
+#endif
+
+    void clear()
+    {
+        count = 0;
+        PHOTON_STAT(pushes = pops = 0);
+    }
+    bool empty() const { return count == 0; }
+    int size() const { return count; }
+
+    // Squared distance of the farthest photon held, i.e. the final gather
+    // radius once the lookup is done. Only valid when !empty().
+    float maxDistSq() const { return entries[0].distSq; }
+
+    void push(float distSq, const P *photon, int maxPhotons, float &maxDistSqOut)
+    {
+        // Nothing is wanted; a zero radius also ends the walk.
+        if (maxPhotons <= 0)
+        {
+            maxDistSqOut = 0.0f;
+            return;
+        }
+        PHOTON_STAT(pushes++);
+        if (count < maxPhotons)
+        {
+            entries[count].distSq = distSq;
+            entries[count].photon = photon;
+            count++;
+            std::push_heap(entries, entries + count);
+            if (count == maxPhotons)
+                maxDistSqOut = entries[0].distSq;
+            return;
+        }
+
+        if (distSq < entries[0].distSq)
+        {
+            PHOTON_STAT(pops++);
+            std::pop_heap(entries, entries + count);
+            entries[count - 1].distSq = distSq;
+            entries[count - 1].photon = photon;
+            std::push_heap(entries, entries + count);
+        }
+        maxDistSqOut = entries[0].distSq;
+    }
+};
+
+// Number of nodes under heap index `index` in a left-balanced tree of n nodes.
+inline size_t kdSubtreeSize(size_t index, size_t n)
+{
+    size_t size = 0;
+    size_t width = 1;
+    for (size_t first = index; first < n; first = 2 * first + 1)
+    {
+        size += std::min(width, n - first);
+        width *= 2;
+    }
+    return size;
+}
+
+template <typename P>
+void kdSegmentBounds(const std::vector<P> &photons, size_t start, size_t end,
+                     Vec3 &bboxMin, Vec3 &bboxMax)
+{
+    bboxMin = Vec3(1e30f, 1e30f, 1e30f);
+    bboxMax = Vec3(-1e30f, -1e30f, -1e30f);
+
+    for (size_t i = start; i < end; i++)
+    {
+        bboxMin = Vec3(
+            std::min(bboxMin.x, photons[i].position.x),
+            std::min(bboxMin.y, photons[i].position.y),
+            std::min(bboxMin.z, photons[i].position.z));
+        bboxMax = Vec3(
+            std::max(bboxMax.x, photons[i].position.x),
+            std::max(bboxMax.y, photons[i].position.y),
+            std::max(bboxMax.z, photons[i].position.z));
+    }
+}
+
+template <typename P>
+void kdBalanceSegment(std::vector<P> &photons, std::vector<P> &balanced, size_t index,
+                      size_t start, size_t end, const std::atomic<bool> *cancel)
+{
+    if (start >= end)
+        return;
+    if (end - start >= BALANCE_TASK_CUTOFF && cancel && *cancel)
+        return;
+
+    Vec3 bboxMin, bboxMax;
+    if (end - start >= BALANCE_PARALLEL_BBOX_CUTOFF)
+    {
+        Vec3 chunkMin[BALANCE_BBOX_CHUNKS], chunkMax[BALANCE_BBOX_CHUNKS];
+        size_t chunkSize = (end - start + BALANCE_BBOX_CHUNKS - 1) / BALANCE_BBOX_CHUNKS;
+        for (int c = 0; c < BALANCE_BBOX_CHUNKS; c++)
+        {
+#pragma omp task shared(photons, chunkMin, chunkMax) firstprivate(c)
+            {
+                size_t chunkStart = std::min(end, start + c * chunkSize);
+                size_t chunkEnd = std::min(end, chunkStart + chunkSize);
+                kdSegmentBounds(photons, chunkStart, chunkEnd, chunkMin[c], chunkMax[c]);
+            }
+        }
+#pragma omp taskwait
+        bboxMin = chunkMin[0];
+        bboxMax = chunkMax[0];
+        for (int c = 1; c < BALANCE_BBOX_CHUNKS; c++)
+        {
+            bboxMin = Vec3(std::min(bboxMin.x, chunkMin[c].x),
+                           std::min(bboxMin.y, chunkMin[c].y),
+                           std::min(bboxMin.z, chunkMin[c].z));
+            bboxMax = Vec3(std::max(bboxMax.x, chunkMax[c].x),
+                           std::max(bboxMax.y, chunkMax[c].y),
+                           std::max(bboxMax.z, chunkMax[c].z));
+        }
+    }
+    else
+    {
+        kdSegmentBounds(photons, start, end, bboxMin, bboxMax);
+    }
+
+    Vec3 extent = bboxMax - bboxMin;
+    int axis = 0;
+    if (extent.y > extent.x && extent.y > extent.z)
+        axis = 1;
+    else if (extent.z > extent.x && extent.z > extent.y)
+        axis = 2;
+
+    // Split so the left segment exactly fills the left subtree of the implicit
+    // heap; a plain midpoint can overflow the array and drop photons.
+    size_t mid = start + kdSubtreeSize(2 * index + 1, balanced.size());
+    std::nth_element(photons.begin() + start, photons.begin() + mid,
+                     photons.begin() + end,
+                     [axis](const P &a, const P &b)
+                     {
+                         return a.position[axis] < b.position[axis];
+                     });
+
+    balanced[index] = photons[mid];
+    balanced[index].axis = axis;
+
+    size_t leftChild = 2 * index + 1;
+    size_t rightChild = 2 * index + 2;
+
+    if (end - start >= BALANCE_TASK_CUTOFF)
+    {
+        if (mid > start && leftChild < balanced.size())
+        {
+#pragma omp task shared(photons, balanced)
+            kdBalanceSegment(photons, balanced, leftChild, start, mid, cancel);
+        }
+        if (mid + 1 < end && rightChild < balanced.size())
+        {
+            kdBalanceSegment(photons, balanced, rightChild, mid + 1, end, cancel);
+        }
+#pragma omp taskwait
+        return;
+    }
+
+    if (mid > start && leftChild < balanced.size())
+    {
+        kdBalanceSegment(photons, balanced, leftChild, start, mid, cancel);
+    }
+    if (mid + 1 < end && rightChild < balanced.size())
+    {
+        kdBalanceSegment(photons, balanced, rightChild, mid + 1, end, cancel);
+    }
+}
+
+// Reorders `photons` into a left-balanced kd-tree in heap order. Once *cancel
+// is set, large segments are skipped and `photons` is left unusable.
+template <typename P>
+void kdBalance(std::vector<P> &photons, const std::atomic<bool> *cancel = nullptr)
+{
+    if (photons.empty())
+        return;
+    std::vector<P> balanced(photons.size());
+    // Subtrees cover disjoint segments and heap slots, so they build as tasks
+    // without changing the layout a single thread would produce.
+#pragma omp parallel
+#pragma omp single nowait
+    kdBalanceSegment(photons, balanced, 0, 0, photons.size(), cancel);
+    photons = std::move(balanced);
+}
+
+// Far-child scale for a (1+epsilon)-approximate k-NN query. Skipping every
+// subtree farther than r / (1 + epsilon) keeps each returned photon within
+// (1 + epsilon) times the distance of the true i-th nearest one (Arya et al.).
+// epsilon = 0 is the exact query.
+inline float photonFarScaleSq(float epsilon)
+{
+    return (1.0f + epsilon) * (1.0f + epsilon);
+}
+
+// Node counters for the walks below. The default counts nothing and compiles
+// away; NodeTally adds every visited node to *count.
+struct NoNodeCount
+{
+    void operator()() const {}
+};
+struct NodeTally
+{
+    uint32_t *count;
+    void operator()() const { ++*count; }
+};
+
+// Iterative nearest-neighbour walk with a fixed-depth stack. Calls
+// visit(photon, distSq) for every photon closer than maxDistSq; the visitor
+// may shrink maxDistSq (it is read again after every call) to prune the walk.
+// A far subtree is entered only while its squared plane distance times
+// farScaleSq is below maxDistSq; see photonFarScaleSq. Traversal counters go
+// to `stats` in PHOTON_STATS builds; countNode() runs once per visited node.
+template <typename P, typename Visitor, typename NodeCounter = NoNodeCount>
+void kdLocateNearest(const P *nodes, size_t count, const Vec3 &pos, float &maxDistSq,
+                     Visitor &&visit, float farScaleSq = 1.0f,
+                     PhotonQueryStats *stats = nullptr, NodeCounter countNode = NodeCounter())
+{
+    (void)stats;
+    if (count == 0)
+        return;
+
+    struct StackEntry
+    {
+        size_t index;
+        float planeDistSq;
+    };
+    StackEntry stack[PHOTON_STACK_DEPTH];
+    int stackSize = 0;
+
+    size_t index = 0;
+
+    while (true)
+    {
+        // Descend towards the query, deferring every far child.
+        while (index < count)
+        {
+            const P &p = nodes[index];
+            int axis = p.axis;
+            float delta = pos[axis] - p.position[axis];
+
+            Vec3 diff = pos - p.position;
+            float distSq = diff.lengthSq();
+            PHOTON_STAT(if (stats) { stats->nodesVisited++; stats->distanceTests++; });
+            countNode();
+            if (distSq < maxDistSq)
+                visit(p, distSq);
+
+            size_t nearChild = (delta < 0) ? (2 * index + 1) : (2 * index + 2);
+            size_t farChild = (delta < 0) ? (2 * index + 2) : (2 * index + 1);
+
+            if (farChild < count)
+            {
+                stack[stackSize].index = farChild;
+                stack[stackSize].planeDistSq = delta * delta * farScaleSq;
+                stackSize++;
+            }
+            index = nearChild;
+        }
+
+        // Resume at the deepest deferred subtree the shrunken radius still reaches.
+        index = count;
+        while (stackSize > 0)
+        {
+            const StackEntry &e = stack[--stackSize];
+            if (e.planeDistSq < maxDistSq)
+            {
+                PHOTON_STAT(if (stats) stats->farDescents++);
+                index = e.index;
+                break;
+            }
+        }
+        if (index == count)
+            break;
+    }
+}
+
+// Fixed-radius walk: calls visit(photon, distSq) for every photon with
+// distSq < radiusSq. The radius never shrinks, so subtrees beyond it are
+// never pushed and no result ordering is kept.
+template <typename P, typename Visitor, typename NodeCounter = NoNodeCount>
+void kdLocateRange(const P *nodes, size_t count, const Vec3 &pos, float radiusSq,
+                   Visitor &&visit, PhotonQueryStats *stats = nullptr,
+                   NodeCounter countNode = NodeCounter())
+{
+    (void)stats;
+    if (count == 0)
+        return;
+
+    size_t stack[PHOTON_STACK_DEPTH];
+    int stackSize = 0;
+    size_t index = 0;
+
+    while (true)
+    {
+        while (index < count)
+        {
+            const P &p = nodes[index];
+            int axis = p.axis;
+            float delta = pos[axis] - p.position[axis];
+
+            Vec3 diff = pos - p.position;
+            float distSq = diff.lengthSq();
+            PHOTON_STAT(if (stats) { stats->nodesVisited++; stats->distanceTests++; });
+            countNode();
+            if (distSq < radiusSq)
+                visit(p, distSq);
+
+            size_t nearChild = (delta < 0) ? (2 * index + 1) : (2 * index + 2);
+            size_t farChild = (delta < 0) ? (2 * index + 2) : (2 * index + 1);
+
+            if (farChild < count && delta * delta < radiusSq)
+                stack[stackSize++] = farChild;
+            index = nearChild;
+        }
+
+        if (stackSize == 0)
+            break;
+        PHOTON_STAT(if (stats) stats->farDescents++);
+        index = stack[--stackSize];
+    }
+}
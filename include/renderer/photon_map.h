@@ -1,7 +1,18 @@
 #pragma once
 #include "camera.h"
+#include "photon_kdtree.h"
+#include "photon_bucket_tree.h"
+#include "photon_irradiance.h"
+#include "photon_veb.h"
+#include "photon_numa.h"
 #include <vector>
 #include <queue>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 struct Photon
 {
@@ -9,6 +20,8 @@ struct Photon
     Vec3 power;
     Vec3 incomingDir;
     short axis;
+    // Surface normal at the hit, quantized with encodePhotonDirection.
+    unsigned char normalTheta, normalPhi;
 };
 
 struct PhotonDistEntry
@@ -20,20 +33,250 @@ struct PhotonDistEntry
         return distSq < other.distSq;
     }
 };
-class PhotonMap {
+
+using PhotonHeap = BasicPhotonHeap<Photon>;
+
+// Photons a thread buffers in PhotonMap::store before claiming room for them
+// in the shared array.
+const size_t PHOTON_STORE_CHUNK = 4096;
+
+// On-disk layout of a balanced PhotonMap: this header, then `count` Photon
+// records in heap order starting at `dataOffset`. The records are used in
+// place, so files only load on machines with the same Photon layout.
+const char PHOTON_MAP_FILE_MAGIC[8] = {'P', 'H', 'O', 'T', 'O', 'N', 'M', 'P'};
+const uint32_t PHOTON_MAP_FILE_VERSION = 2;
+const uint32_t PHOTON_MAP_FILE_BYTE_ORDER = 0x01020304;
+
+struct PhotonMapFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t photonSize;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t dataOffset;
+};
+
+enum class PhotonBackendType
+{
+    KdTree,
+    HashGrid,
+    Incremental,
+    OutOfCore,
+    Surface
+};
+
+// Storage and lookup strategy behind a photon map. Photons are stored while
+// tracing, balance() builds the search structure, and locatePhotons() then
+// gathers the nearest photons into a caller-owned heap.
+class PhotonMapBackend
+{
+public:
+    virtual ~PhotonMapBackend() = default;
+
+    virtual PhotonBackendType type() const = 0;
+    virtual const char *name() const = 0;
+    // `primitive` is the Hit::primitive the photon landed on.
+    virtual void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+                       const Vec3 &normal, int primitive) = 0;
+    // Expected number of stores, for backends that preallocate.
+    virtual void reserve(size_t /*photons*/) {}
+    // Makes photons still buffered by store() visible to size() and lookups.
+    // balance() does this itself.
+    virtual void flushStores() {}
+    // Multiplies the power of every photon stored so far by `factor`, for
+    // callers that only know the final scale once storing is done. Call it
+    // before balance().
+    virtual void scalePower(float factor) = 0;
+    virtual void balance() = 0;
+    // maxPhotons is clamped to MAX_GATHER_PHOTONS.
+    virtual void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                               PhotonHeap &heap) const = 0;
+    // Gathers for `count` queries at once, each starting from initialMaxDistSq;
+    // heaps[i] receives the result for positions[i]. The default runs the
+    // queries one by one.
+    virtual void locatePhotonsBatch(const Vec3 *positions, int count, int maxPhotons,
+                                    float initialMaxDistSq, PhotonHeap *heaps) const;
+    virtual size_t size() const = 0;
+    // The stored photons, in the backend's own order once balanced.
+    virtual const Photon *photonData() const = 0;
+
+    // Precomputes irradiance photons from the balanced map (see
+    // IrradiancePhotonMap); lookupIrradiance() fails until this has run.
+    // Does nothing for backends without resident photons.
+    void precomputeIrradiance(int stride, float initialRadius);
+
+    // Makes locatePhotons a (1+epsilon)-approximate k-NN query: a far subtree
+    // is only searched when it is nearer than the current radius divided by
+    // (1 + epsilon). 0, the default, is exact. The hash grid ignores it.
+    void setApproximation(float epsilon)
+    {
+        approximation = epsilon;
+        farScaleSq = photonFarScaleSq(epsilon);
+    }
+    float approximationEpsilon() const { return approximation; }
+    // Once *flag is set, balance(), precomputeIrradiance() and
+    // PhotonMap::buildVebLayout() stop early and leave the map unusable.
+    void setCancelFlag(const std::atomic<bool> *flag) { cancelFlag = flag; }
+    bool hasIrradiance() const { return !irradiance.empty(); }
+    size_t irradianceSize() const { return irradiance.size(); }
+    bool lookupIrradiance(const Vec3 &pos, const Vec3 &normal, float maxDistSq,
+                          Vec3 &result) const
+    {
+        return irradiance.lookup(pos, normal, maxDistSq, result, threadStats());
+    }
+    uint32_t irradianceLookupNodes(const Vec3 &pos, const Vec3 &normal, float maxDistSq) const
+    {
+        return irradiance.lookupNodes(pos, normal, maxDistSq);
+    }
+
+#ifdef PHOTON_STATS
+    // Lookup counters summed over all threads since the last reset. Only
+    // PhotonMap and irradiance photon lookups record into them.
+    PhotonQueryStats queryStats() const { return stats.total(); }
+    // The calling OpenMP thread's share of queryStats().
+    PhotonQueryStats threadQueryStats() const { return stats.local(); }
+    void resetQueryStats() { stats.reset(); }
+#endif
+
+protected:
+    // The calling thread's counters; null unless built with PHOTON_STATS.
+    PhotonQueryStats *threadStats() const
+    {
+#ifdef PHOTON_STATS
+        return &stats.local();
+#else
+        return nullptr;
+#endif
+    }
+
+    bool cancelled() const { return cancelFlag && *cancelFlag; }
+
+#ifdef PHOTON_STATS
+    mutable PhotonStatsTable stats;
+#endif
+    float approximation = 0.0f;
+    float farScaleSq = 1.0f;
+    const std::atomic<bool> *cancelFlag = nullptr;
+
+private:
+    IrradiancePhotonMap irradiance;
+};
+
+class PhotonMap : public PhotonMapBackend {
 public:
     std::vector<Photon> photons;
 
-    void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir);
-    void balance();
+    PhotonMap();
+    ~PhotonMap();
+    PhotonMap(const PhotonMap &) = delete;
+    PhotonMap &operator=(const PhotonMap &) = delete;
+
+    PhotonBackendType type() const override { return PhotonBackendType::KdTree; }
+    const char *name() const override { return "kd-tree"; }
+    // Safe to call from any number of threads at once, without locks: each
+    // thread fills its own buffer and copies it into the array preallocated
+    // by reserve() through an atomic bump index. Photons beyond that array go
+    // to a mutex-guarded overflow list. They reach `photons` at the next
+    // flushStores() or balance(), in no particular order.
+    void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+               const Vec3 &normal, int primitive) override;
+    // Neither may run concurrently with store().
+    void reserve(size_t photons) override;
+    void flushStores() override;
+    void scalePower(float factor) override;
+    void balance() override;
     void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
                        std::priority_queue<PhotonDistEntry> &heap) const;
-    size_t size() const { return photons.size(); }
+    // Iterative variant: walks the tree with a fixed-depth stack and fills a
+    // caller-owned heap.
+    void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                       PhotonHeap &heap) const override;
+    // Answers the queries in Morton order, seeding each radius from the
+    // previous neighbour's result.
+    void locatePhotonsBatch(const Vec3 *positions, int count, int maxPhotons,
+                            float initialMaxDistSq, PhotonHeap *heaps) const override;
+    // Every photon strictly within sqrt(radiusSq), streamed to
+    // visit(photon, distSq) in tree order with no heap or sorting.
+    template <typename Visitor>
+    void locatePhotonsInRadius(const Vec3 &pos, float radiusSq, Visitor &&visit) const
+    {
+        PhotonQueryStats *stats = threadStats();
+        kdLocateRange(nodeData(), nodeCount(), pos, radiusSq, visit, stats);
+        PHOTON_STAT(stats->queries++; stats->radiusSum += std::sqrt(radiusSq));
+    }
+    // kd-tree nodes that locatePhotons and locatePhotonsInRadius visit for the
+    // query. The walk runs again just to count them, for the cost heatmap.
+    uint32_t lookupNodes(const Vec3 &pos, int maxPhotons, float maxDistSq) const;
+    uint32_t rangeLookupNodes(const Vec3 &pos, float radiusSq) const;
+    // Same query against the bucketed SoA leaves built alongside the tree.
+    void locatePhotonsBucketed(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                               PhotonHeap &heap) const;
+    // Copies the balanced tree into van Emde Boas order for locatePhotonsVeb.
+    // Not done by balance(), since the copy doubles the map's memory.
+    void buildVebLayout();
+    bool hasVebLayout() const { return !veb.empty(); }
+    // Same query against the van Emde Boas copy; falls back to the heap-order
+    // tree until buildVebLayout() has run.
+    void locatePhotonsVeb(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                          PhotonHeap &heap) const;
+    size_t size() const override { return nodeCount(); }
+    const Photon *photonData() const override { return nodeData(); }
+
+    // Writes the balanced map; the file is renamed into place only once
+    // complete, so concurrent readers never see a partial map.
+    bool save(const std::string &path) const;
+    // Maps a saved map read-only and queries it in place. Processes mapping
+    // the same file share its page-cache copy. A mapped map is immutable.
+    bool loadMapped(const std::string &path);
+    bool isMapped() const { return mapped != nullptr; }
+
+    // Serves lookups from read-only copies of the balanced tree: one per NUMA
+    // node when perNode is set (see PhotonReplicas), optionally on huge
+    // pages. Dropped by balance() and loadMapped().
+    void replicate(bool perNode, HugePageMode hugePages)
+    {
+        replicas.build(storageData(), nodeCount(), perNode, hugePages);
+    }
+    std::vector<PhotonReplicaUsage> replicaUsage() const { return replicas.usage(); }
 
 private:
-    void balanceSegment(std::vector<Photon> &balanced, size_t index,
-                        size_t start, size_t end);
+    PhotonBucketTree buckets;
+    PhotonVebTree veb;
+    PhotonReplicas replicas;
+
+    struct StoreBuffer
+    {
+        std::vector<Photon> photons;
+    };
+    uint64_t id;
+    std::vector<std::unique_ptr<StoreBuffer>> storeBuffers; // one per storing thread
+    std::vector<Photon> shared;
+    std::atomic<size_t> sharedCount{0};
+    std::vector<Photon> overflow;
+    std::mutex storeMutex;
+
+    StoreBuffer &threadStoreBuffer();
+    void flushStoreBuffer(StoreBuffer &buffer);
+
+    // Tree nodes live either in `photons` or in a read-only file mapping.
+    const Photon *mapped = nullptr;
+    size_t mappedCount = 0;
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+
+    const Photon *storageData() const { return mapped ? mapped : photons.data(); }
+    // The copy lookups should read: the local replica if there are any.
+    const Photon *nodeData() const
+    {
+        return replicas.empty() ? storageData() : replicas.local();
+    }
+    size_t nodeCount() const { return mapped ? mappedCount : photons.size(); }
+    void unmap();
+
     void locatePhotonsImpl(const Vec3 &pos, size_t index, int maxPhotons,
                            float &maxDistSq,
-                           std::priority_queue<PhotonDistEntry> &heap) const;
+                           std::priority_queue<PhotonDistEntry> &heap,
+                           PhotonQueryStats *stats) const;
 };
\ No newline at end of file
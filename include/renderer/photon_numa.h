@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct Photon;
+
+enum class HugePageMode
+{
+    Off,
+    Transparent, // madvise(MADV_HUGEPAGE)
+    Explicit     // MAP_HUGETLB from the reserved pool, else transparent
+};
+
+// Accepts "off", "thp" or "explicit"; returns false for anything else.
+bool parseHugePageMode(const std::string &name, HugePageMode &mode);
+
+struct PhotonReplicaUsage
+{
+    int node;
+    size_t bytes;
+    // Bytes backed by huge pages when the copy was made: all of them for
+    // MAP_HUGETLB, else what /proc/self/smaps counts as AnonHugePages.
+    size_t hugeBytes;
+    bool thpAdvised; // madvise(MADV_HUGEPAGE) accepted
+};
+
+// Read-only copies of a balanced photon array. With perNode set there is one
+// copy per NUMA node, allocated and first touched by a thread pinned to that
+// node's CPUs so its pages land in the node's memory; lookups then read the
+// copy of the node they run on. Otherwise there is a single copy, which is
+// only useful for its huge-page backing. Linux only; elsewhere build() does
+// nothing and local() stays null.
+class PhotonReplicas
+{
+public:
+    PhotonReplicas() = default;
+    ~PhotonReplicas();
+    PhotonReplicas(const PhotonReplicas &) = delete;
+    PhotonReplicas &operator=(const PhotonReplicas &) = delete;
+
+    void build(const Photon *photons, size_t count, bool perNode, HugePageMode hugePages);
+    void clear();
+    bool empty() const { return replicas.empty(); }
+
+    // Copy for the calling thread's current node; null when there is none.
+    const Photon *local() const;
+    std::vector<PhotonReplicaUsage> usage() const;
+
+private:
+    struct Replica
+    {
+        int node;
+        Photon *data;
+        size_t bytes; // mapped length
+        size_t hugeBytes;
+        bool thpAdvised;
+    };
+
+    std::vector<Replica> replicas;
+    std::vector<int> replicaOfCpu; // -1 for CPUs without a replica
+};
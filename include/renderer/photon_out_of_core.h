@@ -0,0 +1,152 @@
+#pragma once
+#include "photon_map.h"
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Target photons per page. Pages are cut from a sample, so actual sizes vary
+// around this.
+const size_t OUT_OF_CORE_PAGE_PHOTONS = 1 << 16;
+// Photons buffered by store() before they are appended to the spill file,
+// and read per chunk while partitioning.
+const size_t OUT_OF_CORE_SPILL_CHUNK = 1 << 16;
+// Photon positions sampled to place the page boundaries.
+const size_t OUT_OF_CORE_SAMPLE_SIZE = 1 << 20;
+// Page cache size when none is given.
+const size_t OUT_OF_CORE_DEFAULT_CACHE_BYTES = size_t(256) << 20;
+
+struct PhotonPageCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t residentPages = 0;
+    size_t residentPhotons = 0;
+};
+
+// Bounded LRU cache over the pages of a page file. A pinned page stays
+// resident; unpinned pages are evicted least recently used first once the
+// resident photons exceed the capacity. Pinned pages may push the cache past
+// its capacity until they are released.
+class PhotonPageCache
+{
+public:
+    struct Page
+    {
+        uint64_t offset; // in photons
+        uint32_t count;
+    };
+
+    PhotonPageCache(const std::string &path, const std::vector<Page> &pages, size_t capacityPhotons);
+
+    const Photon *pin(uint32_t page);
+    void unpin(uint32_t page);
+
+    PhotonPageCacheStats stats() const;
+    void resetStats();
+
+private:
+    struct Entry
+    {
+        std::vector<Photon> photons;
+        int pins = 0;
+        bool resident = false;
+        std::list<uint32_t>::iterator lruPosition;
+    };
+
+    std::ifstream file;
+    std::vector<Page> pages;
+    std::vector<Entry> entries;
+    std::list<uint32_t> lru; // resident, unpinned; most recently used first
+    size_t capacity;
+    size_t residentPhotons = 0;
+    size_t residentPages = 0;
+    mutable std::mutex mutex;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+
+    void evict(size_t incoming);
+};
+
+// Backend for maps that do not fit in memory. store() appends photons to a
+// spill file. balance() samples them, builds a small top-level kd-tree whose
+// leaves are pages of nearby photons, sorts the photons into a page file and
+// left-balances every page as its own kd-tree. Lookups walk the top tree in
+// memory and read pages through a PhotonPageCache.
+//
+// A lookup keeps the pages it used pinned for the calling thread, so the
+// photons in its heap stay valid until that thread's next lookup on this map
+// (for locatePhotonsBatch, until the next lookup after the whole batch).
+class OutOfCorePhotonMap : public PhotonMapBackend {
+public:
+    // Files go to `directory` and are removed with the map. cacheBytes bounds
+    // the resident pages.
+    OutOfCorePhotonMap(const std::string &directory, size_t cacheBytes,
+                       size_t pagePhotons = OUT_OF_CORE_PAGE_PHOTONS);
+    ~OutOfCorePhotonMap();
+    OutOfCorePhotonMap(const OutOfCorePhotonMap &) = delete;
+    OutOfCorePhotonMap &operator=(const OutOfCorePhotonMap &) = delete;
+
+    PhotonBackendType type() const override { return PhotonBackendType::OutOfCore; }
+    const char *name() const override { return "out-of-core kd-tree"; }
+    void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+               const Vec3 &normal, int primitive) override;
+    // Spilled photons stay on disk; the factor is applied as balance() writes
+    // the pages.
+    void scalePower(float factor) override;
+    // Builds the pages once; photons stored afterwards are dropped.
+    void balance() override;
+    void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                       PhotonHeap &heap) const override;
+    void locatePhotonsBatch(const Vec3 *positions, int count, int maxPhotons,
+                            float initialMaxDistSq, PhotonHeap *heaps) const override;
+    size_t size() const override { return photonCount; }
+    // The photons are never resident all at once, so there is no irradiance
+    // precomputation for this backend.
+    const Photon *photonData() const override { return nullptr; }
+
+    size_t pageCount() const { return pages.size(); }
+    PhotonPageCacheStats cacheStats() const;
+    void resetCacheStats();
+
+private:
+    struct TopNode
+    {
+        float split;
+        int axis;       // -1 for leaves
+        uint32_t right; // inner nodes; the left child is always index + 1
+        uint32_t page;  // leaves
+    };
+
+    class Pins;
+
+    std::string spillPath;
+    std::string pagePath;
+    size_t cacheBytes;
+    size_t pagePhotons;
+    uint64_t id;
+
+    std::vector<Photon> staging;
+    std::ofstream spill;
+    size_t photonCount = 0;
+    float powerScale = 1.0f;
+    bool built = false;
+
+    std::vector<TopNode> top;
+    std::vector<PhotonPageCache::Page> pages;
+    std::unique_ptr<PhotonPageCache> cache;
+
+    void flushStaging();
+    uint32_t buildTop(std::vector<Vec3> &sample, size_t begin, size_t end, size_t leafSample);
+    uint32_t pageOf(const Vec3 &pos) const;
+    Pins &threadPins() const;
+    void locate(const Vec3 &pos, int maxPhotons, float &maxDistSq, PhotonHeap &heap,
+                Pins &pins) const;
+};
@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+#include "renderer/camera.h"
+#include "renderer/photon_stream.h"
+
+// Cells per side of each patch's emission grid.
+const int PROJECTION_MAP_RESOLUTION = 128;
+// The light is split into this many patches per side, each with its own grid.
+const int PROJECTION_MAP_PATCHES = 16;
+
+// Jensen-style projection map for a downward-facing rectangular area light.
+// Each light patch keeps a grid over its cosine-weighted emission hemisphere,
+// (phi / 2pi, sin^2 theta), whose cells all carry the same share of the
+// emitted power. A cell is marked when some direction in it can reach one of
+// the scene's specular spheres from somewhere on the patch; the test is
+// conservative, so no caustic path is ever excluded.
+class PhotonProjectionMap
+{
+public:
+    PhotonProjectionMap(const Vec3 &lightCenter, float halfWidth, float halfDepth);
+
+    // Emission for photon `index`: patches take turns, the origin is uniform
+    // on the patch and the direction uniform over its marked cells. `weight`
+    // is the patch's marked fraction, the factor that keeps the photon's
+    // power unbiased. Returns false when the patch sees no specular object.
+    // Each patch draws from its own point set of the sampler, so a patch's
+    // photons are stratified among themselves.
+    bool sample(int index, PhotonSampler &sampler, Vec3 &origin, Vec3 &direction,
+                float &weight) const;
+
+    // Marked fraction averaged over the patches.
+    float coverage() const;
+
+private:
+    struct Patch
+    {
+        Vec3 center;
+        std::vector<int> markedCells;
+    };
+
+    float patchWidth, patchDepth;
+    std::vector<Patch> patches;
+};
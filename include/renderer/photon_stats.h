@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Traversal counters for photon lookups. They only exist in builds with
+// PHOTON_STATS defined (cmake -DENABLE_PHOTON_STATS=ON); otherwise every
+// PHOTON_STAT(...) expands to nothing and lookups carry no extra work.
+#ifdef PHOTON_STATS
+#define PHOTON_STAT(expr) \
+    do                    \
+    {                     \
+        expr;             \
+    } while (0)
+#else
+#define PHOTON_STAT(expr) \
+    do                    \
+    {                     \
+    } while (0)
+#endif
+
+// Padded to a cache line so threads updating neighbouring slots do not share one.
+struct alignas(64) PhotonQueryStats
+{
+    uint64_t queries = 0;
+    uint64_t nodesVisited = 0;
+    uint64_t distanceTests = 0;
+    uint64_t heapPushes = 0;
+    uint64_t heapPops = 0;
+    uint64_t farDescents = 0;
+    double radiusSum = 0.0; // final gather radius, summed over queries
+
+    void add(const PhotonQueryStats &other)
+    {
+        queries += other.queries;
+        nodesVisited += other.nodesVisited;
+        distanceTests += other.distanceTests;
+        heapPushes += other.heapPushes;
+        heapPops += other.heapPops;
+        farDescents += other.farDescents;
+        radiusSum += other.radiusSum;
+    }
+};
+
+// Threads beyond this share slots, so their counts may race.
+const int PHOTON_STATS_MAX_THREADS = 256;
+
+// One slot per OpenMP thread; a lookup only ever writes its own thread's slot.
+class PhotonStatsTable
+{
+public:
+    PhotonQueryStats &local()
+    {
+#ifdef _OPENMP
+        return slots[omp_get_thread_num() % PHOTON_STATS_MAX_THREADS];
+#else
+        return slots[0];
+#endif
+    }
+
+    PhotonQueryStats total() const
+    {
+        PhotonQueryStats sum;
+        for (const PhotonQueryStats &s : slots)
+            sum.add(s);
+        return sum;
+    }
+
+    void reset()
+    {
+        for (PhotonQueryStats &s : slots)
+            s = PhotonQueryStats();
+    }
+
+private:
+    PhotonQueryStats slots[PHOTON_STATS_MAX_THREADS];
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <functional>
+#include <vector>
+#include "renderer/camera.h"
+#include "renderer/counter_rng.h"
+#include "renderer/sampler.h"
+
+// Photon paths advanced together by tracePhotonStream: one AVX2 register, two
+// SSE2 ones, or plain loops where neither is available.
+const int PHOTON_STREAM_WIDTH = 8;
+
+// A photon a tracer found, stored into its map later in emission order. Its
+// power is relative to one emitted photon carrying the light's full power.
+struct TracedPhoton
+{
+    Vec3 position;
+    Vec3 power;
+    Vec3 incomingDir;
+    Vec3 normal;
+    int primitive;
+    int emission; // index of the emitted photon whose path stored it
+};
+
+// How a path bounces and where it leaves photons. Caustic paths follow
+// specular bounces (at most 20) and store at the first diffuse hit after one;
+// global paths store at every diffuse hit but the first and continue by
+// Russian roulette (at most 10 bounces).
+enum class PhotonPathRule
+{
+    Caustic,
+    Global
+};
+
+using PhotonSampler = Sampler<CounterRng>;
+
+// Sampler dimensions of a photon path: the emission takes the first
+// PHOTON_EMISSION_DIMENSIONS, then every bounce PHOTON_BOUNCE_DIMENSIONS
+// (the Fresnel or Russian roulette choice, then a diffuse direction).
+const int PHOTON_EMISSION_DIMENSIONS = 5;
+const int PHOTON_BOUNCE_DIMENSIONS = 3;
+
+inline int photonBounceDimension(int bounce, int slot)
+{
+    return PHOTON_EMISSION_DIMENSIONS + bounce * PHOTON_BOUNCE_DIMENSIONS + slot;
+}
+
+// Photon i's sampler: point i of `sequence` (none for plain random draws)
+// under a scramble of (seed, firstStream), falling back to
+// CounterRng(seed, firstStream + i).
+inline PhotonSampler photonSampler(const SampleSequence *sequence, uint32_t seed,
+                                   uint64_t firstStream, int i)
+{
+    return PhotonSampler(CounterRng(seed, firstStream + i), sequence, (uint32_t)i,
+                         scrambleKey(seed, firstStream));
+}
+
+// Fills in the origin, direction and power of emitted photon `index`;
+// returns false when that photon is not emitted at all.
+using PhotonEmitFn = std::function<bool(int index, PhotonSampler &sampler, Vec3 &origin,
+                                        Vec3 &direction, Vec3 &power)>;
+
+// Traces photons [first, last) with PHOTON_STREAM_WIDTH paths in flight: each
+// step intersects every lane with the scene and applies mirror and glass
+// bounces as masked vector operations, and lanes whose path ended are
+// refilled from the remaining emissions. Photon i draws from
+// photonSampler(sequence, seed, firstStream, i) exactly as the scalar tracer
+// does, and `out` receives its photons in emission order.
+void tracePhotonStream(PhotonPathRule rule, int first, int last, uint32_t seed,
+                       uint64_t firstStream, const SampleSequence *sequence,
+                       const PhotonEmitFn &emit, std::vector<TracedPhoton> &out);
@@ -0,0 +1,53 @@
+#pragma once
+#include "photon_map.h"
+#include "scene.h"
+#include <vector>
+
+// Queries farther than this from every receiver plane search all surfaces.
+const float SURFACE_PLANE_EPSILON = 0.01f;
+
+// One 2D kd-tree per receiver plane of the scene (see scenePlane), built over
+// the photons' in-plane coordinates, plus a 3D tree for photons landing on
+// anything else. A query on a receiver searches only that receiver's tree, so
+// a gather near a corner never picks up photons from the adjoining wall. Any
+// other query searches every tree and gets the exact 3D nearest photons.
+class SurfacePhotonMap : public PhotonMapBackend {
+public:
+    PhotonBackendType type() const override { return PhotonBackendType::Surface; }
+    const char *name() const override { return "per-surface 2D kd-trees"; }
+    void store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+               const Vec3 &normal, int primitive) override;
+    void scalePower(float factor) override;
+    void balance() override;
+    void locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                       PhotonHeap &heap) const override;
+    size_t size() const override;
+    // Grouped by surface, each group in its tree's heap order.
+    const Photon *photonData() const override { return photons.data(); }
+
+    size_t surfaceSize(int primitive) const { return surfaceEnd[primitive] - surfaceStart[primitive]; }
+
+private:
+    // In-plane coordinates (u, v, 0); the zero third coordinate is never
+    // split on, so kdBalance and kdLocateNearest work on it unchanged and a
+    // query's plane distance simply adds to every squared distance.
+    struct Node
+    {
+        Vec3 position;
+        short axis;
+    };
+
+    // photons[surfaceStart[s], surfaceEnd[s]) belong to receiver s and
+    // nodes[i] is photons[i]'s node; the photons on other primitives follow
+    // as a 3D tree starting at surfaceEnd[SCENE_PLANE_COUNT - 1].
+    std::vector<Photon> photons;
+    std::vector<Node> nodes;
+    size_t surfaceStart[SCENE_PLANE_COUNT] = {};
+    size_t surfaceEnd[SCENE_PLANE_COUNT] = {};
+
+    // Photons by primitive until balance(); index SCENE_PLANE_COUNT holds the rest.
+    std::vector<Photon> pending[SCENE_PLANE_COUNT + 1];
+
+    void locateOnSurface(int surface, const Vec3 &query, int maxPhotons, float &maxDistSq,
+                         PhotonHeap &heap) const;
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include "camera.h"
+#include "photon_kdtree.h"
+#include <vector>
+#include <cstdint>
+#include <atomic>
+
+struct Photon;
+
+// Search skeleton of a balanced photon kd-tree with its nodes in van Emde
+// Boas order: the top half of the levels is stored first, followed by each
+// bottom subtree as one contiguous block, recursively. A root-to-leaf walk
+// then touches O(log n / log B) cache lines or pages, whereas in heap order
+// every level deeper than the first few is a separate miss. Nodes only hold
+// what the descent needs (24 bytes); the photons themselves stay in the
+// heap-ordered array, passed to each lookup so that it can be any copy of
+// it, and are read only when they pass the distance test.
+class PhotonVebTree
+{
+public:
+    // `photons` must be a left-balanced tree in heap order. Leaves the
+    // skeleton empty once *cancel is set.
+    void build(const Photon *photons, size_t count, const std::atomic<bool> *cancel = nullptr);
+    void clear() { nodes.clear(); }
+    bool empty() const { return nodes.empty(); }
+    size_t size() const { return nodes.size(); }
+
+    // Same results as kdLocateNearest on the heap-ordered tree `photons`,
+    // the array build() saw or a copy of it.
+    void locatePhotons(const Photon *photons, const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                       BasicPhotonHeap<Photon> &heap, float farScaleSq = 1.0f,
+                       PhotonQueryStats *stats = nullptr) const;
+
+private:
+    static const uint32_t NO_CHILD = 0xffffffffu;
+
+    // The split axis sits in the top two bits of `photon`, the heap index.
+    static const uint32_t AXIS_SHIFT = 30;
+    static const uint32_t INDEX_MASK = (1u << AXIS_SHIFT) - 1;
+
+    struct Node
+    {
+        float position[3];
+        uint32_t photon;
+        uint32_t left;
+        uint32_t right;
+    };
+    std::vector<Node> nodes;
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "renderer/camera.h"
+#include "renderer/photon_map.h"
+
+// Work spent shading one pixel through trace().
+struct PixelCost
+{
+    // kd-tree nodes visited by the pixel's irradiance lookups and, with the
+    // kd-tree backend, its photon gathers; counted by a repeat of each lookup.
+    uint32_t photonNodes = 0;
+    uint32_t intersections = 0; // intersectScene calls, shadow rays included
+    uint32_t maxDepth = 0;      // deepest trace() recursion reached
+};
+
+// Counters for the pixel the calling thread is shading; null outside
+// renderCostFrame, so the hooks in intersectScene and trace are a single test.
+extern thread_local PixelCost *activePixelCost;
+
+// Renders WIDTH x HEIGHT pixels through trace() and records each pixel's cost
+// (row-major, bottom row first like the CPU frame buffer).
+void renderCostFrame(const CPUCamera &cam, const PhotonMapBackend &causticMap,
+                     const PhotonMapBackend &globalMap, int frameIndex,
+                     std::vector<PixelCost> &costs);
+// False-colour RGB image (blue = cheap, red = expensive) of photon nodes
+// visited, or of intersectScene calls when no lookup walked a tree. The scale
+// is logarithmic up to the frame's most expensive pixel.
+void costHeatmap(const std::vector<PixelCost> &costs, std::vector<unsigned char> &frameData);
+// Writes three floats per pixel (photon nodes, intersections, max depth),
+// top row first like savePPM, with no header.
+void saveCostBuffer(const std::vector<PixelCost> &costs, int width, int height,
+                    const char *filename);
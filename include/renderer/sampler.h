@@ -0,0 +1,98 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <utility>
+
+enum class SamplerType
+{
+    Random,
+    Halton,
+    Sobol
+};
+
+// Accepts "random", "halton" or "sobol"; returns false for anything else.
+bool parseSamplerType(const std::string &name, SamplerType &type);
+const char *samplerTypeName(SamplerType type);
+
+// A low-discrepancy point set in [0, 1)^dimensions(). The scramble key picks
+// one randomization of it: points under the same key stay stratified
+// against each other, different keys are independent copies.
+class SampleSequence
+{
+public:
+    virtual ~SampleSequence() = default;
+    virtual int dimensions() const = 0;
+    // Coordinate `dimension` of point `index` as a 32-bit fixed-point fraction.
+    virtual uint32_t sample(uint32_t index, int dimension, uint64_t scramble) const = 0;
+};
+
+// Radical inverses in the first dimensions() primes, each digit shifted by
+// a random amount per scramble key, dimension and digit position.
+class HaltonSequence : public SampleSequence
+{
+public:
+    int dimensions() const override;
+    uint32_t sample(uint32_t index, int dimension, uint64_t scramble) const override;
+};
+
+// Sobol' points from Joe and Kuo's direction numbers, with a random digital
+// shift (an XOR) per scramble key and dimension.
+class SobolSequence : public SampleSequence
+{
+public:
+    SobolSequence();
+    int dimensions() const override { return DIMENSIONS; }
+    uint32_t sample(uint32_t index, int dimension, uint64_t scramble) const override;
+
+private:
+    static const int DIMENSIONS = 21;
+    uint32_t directions[DIMENSIONS][32];
+};
+
+// The shared sequence for `type`; null for SamplerType::Random.
+const SampleSequence *sampleSequence(SamplerType type);
+
+// Key for point set `set` under `key`; stands in for hashing both together.
+uint64_t scrambleKey(uint64_t key, uint64_t set);
+
+// The random numbers of one sample, such as a photon path or a pixel. get(d)
+// is coordinate d of the sequence's current point while the sequence has
+// that dimension, and the generator's next uniform draw otherwise. Callers
+// give each decision of a path its own dimension, so a bounce's draws line
+// up with the same bounce of every other sample. With no sequence every
+// get() is simply the next draw, in call order.
+template <typename Rng>
+class Sampler
+{
+public:
+    Sampler(Rng rng, const SampleSequence *sequence = nullptr, uint32_t index = 0,
+            uint64_t scramble = 0)
+        : generator(std::move(rng)), sequence(sequence), index(index), baseScramble(scramble),
+          scramble(scramble)
+    {
+    }
+
+    // Draw from point `pointIndex` of independent copy `set` of the sequence
+    // instead, for samples that are stratified per group.
+    void usePointSet(uint64_t set, uint32_t pointIndex)
+    {
+        scramble = scrambleKey(baseScramble, set);
+        index = pointIndex;
+    }
+
+    float get(int dimension)
+    {
+        if (sequence && dimension < sequence->dimensions())
+            return std::min(sequence->sample(index, dimension, scramble) * 0x1p-32f, 0x1.fffffep-1f);
+        return std::uniform_real_distribution<float>(0.0f, 1.0f)(generator);
+    }
+
+private:
+    Rng generator;
+    const SampleSequence *sequence;
+    uint32_t index;
+    uint64_t baseScramble;
+    uint64_t scramble;
+};
@@ -10,18 +10,60 @@ extern Texture backWallTexture;
 extern Texture ceilingTexture;
 extern bool texturesEnabled;
 
+// Ids reported in Hit::primitive. The first SCENE_PLANE_COUNT are the
+// axis-aligned diffuse receivers described by scenePlane().
+enum ScenePrimitive {
+    PRIM_FLOOR,
+    PRIM_CEILING,
+    PRIM_BACK_WALL,
+    PRIM_RED_WALL,
+    PRIM_GREEN_WALL,
+    PRIM_LIGHT,
+    PRIM_GLASS_SPHERE,
+    PRIM_MIRROR_SPHERE
+};
+const int SCENE_PLANE_COUNT = 5;
+
+// Receiver plane p[axis] == offset, facing normalSign along axis, bounded by
+// [minU, maxU] x [minV, maxV] in its in-plane coordinates p[uAxis], p[vAxis]
+// (the ones intersectPlane derives u and v from).
+struct ScenePlane {
+    int axis;
+    float offset;
+    int uAxis, vAxis;
+    float normalSign;
+    float minU, maxU, minV, maxV;
+    int material;
+    int textureId;
+};
+
+struct SceneSphere {
+    Vec3 center;
+    float radius;
+    int material;
+    int primitive;
+};
+// The glass and mirror spheres; the only specular objects in the scene.
+const int SCENE_SPHERE_COUNT = 2;
+
 struct Hit {
     float t = 1e30f;
     Vec3 point, normal;
     float u = 0, v = 0;
     int material = -1;
     int textureId = -1;
+    int primitive = -1;
 };
 
 Vec3 getMaterialColor(int mat, float u = 0, float v = 0, int textureId = -1);
 float getMaterialAlpha(int mat);
-bool intersectSphere(Vec3 ro, Vec3 rd, Vec3 center, float radius, Hit &hit, int mat);
+bool intersectSphere(Vec3 ro, Vec3 rd, Vec3 center, float radius, Hit &hit, int mat,
+                     int primitive = -1);
 bool intersectPlane(Vec3 ro, Vec3 rd, Vec3 p0, Vec3 normal,
                     float minA, float maxA, float minB, float maxB,
-                    Hit &hit, int mat, int texId = -1);
-bool intersectScene(Vec3 ro, Vec3 rd, Hit &hit, bool includeLight = true);
\ No newline at end of file
+                    Hit &hit, int mat, int texId = -1, int primitive = -1);
+bool intersectScene(Vec3 ro, Vec3 rd, Hit &hit, bool includeLight = true);
+// primitive must be below SCENE_PLANE_COUNT.
+ScenePlane scenePlane(int primitive);
+// index must be below SCENE_SPHERE_COUNT.
+const SceneSphere &sceneSphere(int index);
\ No newline at end of file
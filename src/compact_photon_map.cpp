@@ -0,0 +1,66 @@
+#include "renderer/compact_photon_map.h"
+#include "renderer/photon_direction.h"
+#include <cmath>
+#include <algorithm>
+
+void CompactPhoton::setPower(const Vec3 &p)
+{
+    float v = std::max(p.x, std::max(p.y, p.z));
+    if (v < 1e-32f)
+    {
+        power[0] = power[1] = power[2] = power[3] = 0;
+        return;
+    }
+
+    int e;
+    float scale = std::frexp(v, &e) * 256.0f / v;
+    power[0] = (unsigned char)std::max(0.0f, p.x * scale);
+    power[1] = (unsigned char)std::max(0.0f, p.y * scale);
+    power[2] = (unsigned char)std::max(0.0f, p.z * scale);
+    power[3] = (unsigned char)(e + 128);
+}
+
+Vec3 CompactPhoton::decodePower() const
+{
+    if (power[3] == 0)
+        return Vec3(0, 0, 0);
+    float f = std::ldexp(1.0f, (int)power[3] - (128 + 8));
+    return Vec3((power[0] + 0.5f) * f, (power[1] + 0.5f) * f, (power[2] + 0.5f) * f);
+}
+
+void CompactPhoton::setDirection(const Vec3 &d)
+{
+    encodePhotonDirection(d, theta, phi);
+}
+
+Vec3 CompactPhoton::decodeDirection() const
+{
+    return decodePhotonDirection(theta, phi);
+}
+
+void CompactPhotonMap::store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir)
+{
+    CompactPhoton p;
+    p.position = pos;
+    p.setPower(power);
+    p.setDirection(inDir);
+    p.axis = 0;
+    p.flags = 0;
+    photons.push_back(p);
+}
+
+void CompactPhotonMap::balance()
+{
+    kdBalance(photons);
+}
+
+void CompactPhotonMap::locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                     CompactPhotonHeap &heap) const
+{
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+    kdLocateNearest(photons.data(), photons.size(), pos, maxDistSq,
+                    [&](const CompactPhoton &p, float distSq)
+                    {
+                        heap.push(distSq, &p, maxPhotons, maxDistSq);
+                    });
+}
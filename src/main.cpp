@@ -4,11 +4,23 @@
 #include "renderer/camera.h"
 #include "renderer/renderer_cpu.h"
 #include "renderer/renderer_gpu.h"
+#include "renderer/photon_backend.h"
+#include "renderer/photon_bench.h"
+#include "renderer/render_cost.h"
 #include "renderer/scene.h"
 #include "renderer/texture.h"
 #include "renderer/utils.h"
 #include <glm/gtc/type_ptr.hpp>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iomanip>
+#include <sstream>
 #include <vector>
 #include "renderer/shader_utils.h"
 static float *g_deltaTime = nullptr;
@@ -45,8 +57,442 @@ void cpu_cursor_callback(GLFWwindow *window, double x, double y)
         CPUCameraControl::cursorPosCallback(window, x, y, *g_cameraMoving_cpu);
     }
 }
-int main()
+struct PhotonOptions
 {
+    PhotonBackendType causticBackend = PhotonBackendType::KdTree;
+    PhotonBackendType globalBackend = PhotonBackendType::KdTree;
+    std::string cacheDir;
+    // Out-of-core maps: file directory (defaults to cacheDir, else the
+    // working directory) and page cache budget per map.
+    std::string spillDir;
+    long long photonMemoryMB = OUT_OF_CORE_DEFAULT_CACHE_BYTES >> 20;
+    // Photons emitted per map, or stored when the stored count is nonzero.
+    long long causticPhotons = CAUSTIC_PHOTON_COUNT;
+    long long globalPhotons = GLOBAL_PHOTON_COUNT;
+    long long causticStored = 0;
+    long long globalStored = 0;
+    long long gatherPhotons = MAX_GATHER_PHOTONS;
+    bool scalarPhotons = false;
+    bool photonImportance = false;
+    SamplerType sampler = SamplerType::Random;
+    float causticEpsilon = CAUSTIC_GATHER_EPSILON;
+    float globalEpsilon = GLOBAL_GATHER_EPSILON;
+    bool numaReplicate = false;
+    HugePageMode hugePages = HugePageMode::Off;
+    bool benchLayout = false;
+    bool benchApprox = false;
+    bool benchCompact = false;
+};
+
+static bool parseEpsilon(const std::string &value, float &epsilon)
+{
+    char *end = nullptr;
+    float parsed = std::strtof(value.c_str(), &end);
+    if (value.empty() || *end != '\0' || !(parsed >= 0.0f))
+        return false;
+    epsilon = parsed;
+    return true;
+}
+
+static bool parsePositive(const std::string &value, long long max, long long &result)
+{
+    char *end = nullptr;
+    long long parsed = std::strtoll(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || parsed <= 0 || parsed > max)
+        return false;
+    result = parsed;
+    return true;
+}
+
+static bool parseOptions(int argc, char **argv, PhotonOptions &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = arg.substr(arg.find('=') + 1);
+
+        if (arg.rfind("--caustic-backend=", 0) == 0 &&
+            parsePhotonBackendType(value, options.causticBackend))
+            continue;
+        if (arg.rfind("--global-backend=", 0) == 0 &&
+            parsePhotonBackendType(value, options.globalBackend))
+            continue;
+        if (arg.rfind("--caustic-epsilon=", 0) == 0 && parseEpsilon(value, options.causticEpsilon))
+            continue;
+        if (arg.rfind("--global-epsilon=", 0) == 0 && parseEpsilon(value, options.globalEpsilon))
+            continue;
+        if (arg.rfind("--caustic-photons=", 0) == 0 &&
+            parsePositive(value, INT_MAX, options.causticPhotons))
+            continue;
+        if (arg.rfind("--global-photons=", 0) == 0 &&
+            parsePositive(value, INT_MAX, options.globalPhotons))
+            continue;
+        if (arg.rfind("--caustic-stored=", 0) == 0 &&
+            parsePositive(value, INT_MAX, options.causticStored))
+            continue;
+        if (arg.rfind("--global-stored=", 0) == 0 &&
+            parsePositive(value, INT_MAX, options.globalStored))
+            continue;
+        if (arg.rfind("--gather-photons=", 0) == 0 &&
+            parsePositive(value, MAX_GATHER_PHOTONS, options.gatherPhotons))
+            continue;
+        if (arg.rfind("--sampler=", 0) == 0 && parseSamplerType(value, options.sampler))
+            continue;
+        if (arg == "--scalar-photons")
+        {
+            options.scalarPhotons = true;
+            continue;
+        }
+        if (arg == "--photon-importance")
+        {
+            options.photonImportance = true;
+            continue;
+        }
+        if (arg.rfind("--photon-memory=", 0) == 0 &&
+            parsePositive(value, LLONG_MAX >> 20, options.photonMemoryMB))
+            continue;
+        if (arg.rfind("--photon-spill=", 0) == 0 && !value.empty())
+        {
+            options.spillDir = value;
+            continue;
+        }
+        if (arg == "--numa-replicate")
+        {
+            options.numaReplicate = true;
+            continue;
+        }
+        if (arg.rfind("--huge-pages=", 0) == 0 && parseHugePageMode(value, options.hugePages))
+            continue;
+        if (arg == "--bench-layout")
+        {
+            options.benchLayout = true;
+            continue;
+        }
+        if (arg == "--bench-approx")
+        {
+            options.benchApprox = true;
+            continue;
+        }
+        if (arg == "--bench-compact")
+        {
+            options.benchCompact = true;
+            continue;
+        }
+        if (arg.rfind("--photon-cache=", 0) == 0 && !value.empty())
+        {
+            options.cacheDir = value;
+            continue;
+        }
+
+        std::cerr << "Unknown option: " << arg << "\n";
+        std::cerr << "Usage: " << argv[0]
+                  << " [--caustic-backend=kdtree|grid|incremental|outofcore|surface]"
+                  << " [--global-backend=kdtree|grid|incremental|outofcore|surface]"
+                  << " [--caustic-epsilon=E] [--global-epsilon=E]"
+                  << " [--caustic-photons=N] [--global-photons=N]"
+                  << " [--caustic-stored=N] [--global-stored=N] [--gather-photons=K]"
+                  << " [--sampler=random|halton|sobol] [--scalar-photons]"
+                  << " [--photon-importance]"
+                  << " [--photon-spill=DIR] [--photon-memory=MB]"
+                  << " [--numa-replicate] [--huge-pages=off|thp|explicit]"
+                  << " [--photon-cache=DIR] [--bench-layout] [--bench-approx]"
+                  << " [--bench-compact]\n";
+        return false;
+    }
+    return true;
+}
+
+static void buildPhotonMap(PhotonMapBackend &map, const char *label)
+{
+    std::cout << "Balancing " << label << " photon map (" << map.name() << ")...\n";
+    auto start = std::chrono::steady_clock::now();
+    map.balance();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  " << label << " build: " << ms << " ms for " << map.size() << " photons\n";
+}
+
+#ifdef PHOTON_STATS
+// Per-query averages of the lookups made since the last report.
+static void reportPhotonStats(PhotonMapBackend &map, const char *label)
+{
+    PhotonQueryStats s = map.queryStats();
+    map.resetQueryStats();
+    if (s.queries == 0)
+        return;
+    double n = (double)s.queries;
+    std::cout << "  " << label << " lookups: " << s.queries
+              << " | nodes " << s.nodesVisited / n
+              << " | dist tests " << s.distanceTests / n
+              << " | pushes " << s.heapPushes / n
+              << " | pops " << s.heapPops / n
+              << " | far descents " << s.farDescents / n
+              << " | radius " << s.radiusSum / n << "\n";
+}
+#endif
+
+// Page cache activity of out-of-core maps since the last report.
+static void reportPageCache(PhotonMapBackend &map, const char *label)
+{
+    if (map.type() != PhotonBackendType::OutOfCore)
+        return;
+    OutOfCorePhotonMap &ooc = static_cast<OutOfCorePhotonMap &>(map);
+    PhotonPageCacheStats s = ooc.cacheStats();
+    ooc.resetCacheStats();
+    uint64_t accesses = s.hits + s.misses;
+    std::cout << "  " << label << " page cache: " << s.hits << " hits, " << s.misses << " misses ("
+              << (accesses ? 100.0 * s.hits / accesses : 0.0) << "% hit), " << s.evictions
+              << " evictions, " << s.residentPages << "/" << ooc.pageCount() << " pages resident\n";
+}
+
+static void replicatePhotonMap(PhotonMapBackend &map, const char *label,
+                               const PhotonOptions &options)
+{
+    if (map.type() != PhotonBackendType::KdTree)
+        return;
+    PhotonMap &kdMap = static_cast<PhotonMap &>(map);
+    kdMap.replicate(options.numaReplicate, options.hugePages);
+    for (const PhotonReplicaUsage &u : kdMap.replicaUsage())
+    {
+        std::cout << "  " << label << " replica on node " << u.node << ": "
+                  << u.bytes / (1024.0 * 1024.0) << " MB";
+        if (u.hugeBytes > 0)
+            std::cout << " (" << u.hugeBytes / (1024.0 * 1024.0) << " MB in huge pages)";
+        else if (u.thpAdvised)
+            std::cout << " (THP advised, no huge pages yet)";
+        std::cout << "\n";
+    }
+}
+
+// The van Emde Boas copy costs 24 bytes per photon, so a kd-tree map only
+// gets one the first time the V key asks for it.
+static void ensureVebLayout(PhotonMapBackend &map, const char *label)
+{
+    if (map.type() != PhotonBackendType::KdTree)
+        return;
+    PhotonMap &kdMap = static_cast<PhotonMap &>(map);
+    if (kdMap.hasVebLayout())
+        return;
+    auto start = std::chrono::steady_clock::now();
+    kdMap.buildVebLayout();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  " << label << " van Emde Boas layout: " << ms << " ms for " << kdMap.size()
+              << " photons\n";
+}
+
+// Seed of the photon tracing RNG; part of the cache file names with the counts.
+static const unsigned PHOTON_SEED = 42;
+// Bumped when tracePhotons draws different photons for the same seed, so
+// caches from an older tracer are not picked up.
+static const int PHOTON_TRACER_VERSION = 5;
+
+// "s<stored>" for maps shot until a stored count, else the emitted count.
+static std::string photonBudgetTag(int emitted, int stored)
+{
+    return stored > 0 ? "s" + std::to_string(stored) : std::to_string(emitted);
+}
+
+static std::string photonCachePath(const std::string &dir, const char *label,
+                                   const std::string &budgetTag)
+{
+    return dir + "/" + label + "-" + budgetTag + "-" + samplerTypeName(samplerType) + "-" +
+           std::to_string(PHOTON_SEED) +
+           "-t" + std::to_string(PHOTON_TRACER_VERSION) + "-v" + std::to_string(PHOTON_MAP_FILE_VERSION) +
+           ".pmap";
+}
+
+// Cache label of an importance-driven global map. The startup camera's pose
+// is hashed into it, so moving that camera traces a fresh map.
+static std::string importanceCacheLabel(const CPUCamera &camera)
+{
+    const float pose[] = {camera.position.x, camera.position.y, camera.position.z, camera.yaw,
+                          camera.pitch};
+    uint64_t hash = 0;
+    for (float value : pose)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        hash = scrambleKey(hash, bits);
+    }
+    std::ostringstream label;
+    label << "global-importance-" << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return label.str();
+}
+
+// Maps both cached kd-tree maps, or neither so the caller can trace afresh.
+static bool loadCachedPhotonMaps(const std::string &dir, const PhotonBudget &budget,
+                                 const char *globalLabel,
+                                 std::unique_ptr<PhotonMapBackend> &causticMap,
+                                 std::unique_ptr<PhotonMapBackend> &globalMap)
+{
+    std::unique_ptr<PhotonMap> caustic = std::make_unique<PhotonMap>();
+    std::unique_ptr<PhotonMap> global = std::make_unique<PhotonMap>();
+    if (!caustic->loadMapped(photonCachePath(
+            dir, "caustic", photonBudgetTag(budget.causticEmitted, budget.causticStored))) ||
+        !global->loadMapped(photonCachePath(
+            dir, globalLabel, photonBudgetTag(budget.globalEmitted, budget.globalStored))))
+        return false;
+
+    std::cout << "Mapped cached photon maps from " << dir << " (" << caustic->size()
+              << " caustic, " << global->size() << " global photons)\n";
+    causticMap = std::move(caustic);
+    globalMap = std::move(global);
+    return true;
+}
+
+// Both photon maps of the CPU modes, handed over together once built.
+struct CpuPhotonMaps
+{
+    std::unique_ptr<PhotonMapBackend> caustic;
+    std::unique_ptr<PhotonMapBackend> global;
+};
+
+// The finished build's maps; none, with the error reported, if it threw.
+static CpuPhotonMaps takePhotonMaps(std::future<CpuPhotonMaps> &pending)
+{
+    try
+    {
+        return pending.get();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Photon map build failed: " << e.what() << std::endl;
+    }
+    return CpuPhotonMaps();
+}
+
+// Step buildCpuPhotonMaps is on, shown in the window title meanwhile.
+static std::atomic<const char *> photonBuildStage{"starting"};
+
+// Loads the CPU path's textures and traces, builds and reports both photon
+// maps. `camera` is the startup camera, for importance and lookup timing.
+// Once cancelPhotonTracing is set the current step stops early and no maps
+// are returned.
+static CpuPhotonMaps buildCpuPhotonMaps(const PhotonOptions &photonOptions, const CPUCamera &camera)
+{
+    photonBuildStage = "loading textures";
+    std::cout << "=== Loading Textures (CPU path) ===\n";
+    floorTexture.load("textures/checkerboard.ppm");
+    backWallTexture.load("textures/brick_wall.ppm");
+    ceilingTexture.load("textures/ceiling.ppm");
+    std::cout << "===================================\n";
+
+    std::cout << "=== Pre-computing Photon Maps (CPU path) ===\n";
+    std::string spillDir = !photonOptions.spillDir.empty() ? photonOptions.spillDir
+                           : !photonOptions.cacheDir.empty() ? photonOptions.cacheDir
+                                                             : ".";
+    size_t photonMemory = (size_t)photonOptions.photonMemoryMB << 20;
+    PhotonBudget budget;
+    budget.causticEmitted = (int)photonOptions.causticPhotons;
+    budget.globalEmitted = (int)photonOptions.globalPhotons;
+    budget.causticStored = (int)photonOptions.causticStored;
+    budget.globalStored = (int)photonOptions.globalStored;
+    std::unique_ptr<PhotonMapBackend> causticMapPtr =
+        createPhotonMap(photonOptions.causticBackend, CAUSTIC_RADIUS, spillDir, photonMemory);
+    std::unique_ptr<PhotonMapBackend> globalMapPtr =
+        createPhotonMap(photonOptions.globalBackend, INITIAL_RADIUS, spillDir, photonMemory);
+    std::mt19937 rng(PHOTON_SEED);
+
+    // Only kd-tree maps have an on-disk format.
+    bool cacheable = !photonOptions.cacheDir.empty() &&
+                     photonOptions.causticBackend == PhotonBackendType::KdTree &&
+                     photonOptions.globalBackend == PhotonBackendType::KdTree;
+    if (!photonOptions.cacheDir.empty() && !cacheable)
+        std::cout << "Photon cache needs kd-tree backends; ignoring --photon-cache\n";
+    std::string globalCacheLabel =
+        photonOptions.photonImportance ? importanceCacheLabel(camera) : "global";
+
+    if (cacheable)
+        photonBuildStage = "mapping cached maps";
+    if (!cacheable ||
+        !loadCachedPhotonMaps(photonOptions.cacheDir, budget, globalCacheLabel.c_str(), causticMapPtr,
+                              globalMapPtr))
+    {
+        photonBuildStage = "tracing photons";
+        causticMapPtr->setCancelFlag(&cancelPhotonTracing);
+        globalMapPtr->setCancelFlag(&cancelPhotonTracing);
+        tracePhotons(*causticMapPtr, *globalMapPtr, PHOTON_SEED, budget,
+                     photonOptions.photonImportance ? &camera : nullptr);
+        if (cancelPhotonTracing)
+            return CpuPhotonMaps();
+        photonBuildStage = "balancing";
+        buildPhotonMap(*causticMapPtr, "caustic");
+        if (cancelPhotonTracing)
+            return CpuPhotonMaps();
+        buildPhotonMap(*globalMapPtr, "global");
+        if (cancelPhotonTracing)
+            return CpuPhotonMaps();
+
+        if (cacheable)
+        {
+            static_cast<PhotonMap &>(*causticMapPtr)
+                .save(photonCachePath(photonOptions.cacheDir, "caustic",
+                                      photonBudgetTag(budget.causticEmitted, budget.causticStored)));
+            static_cast<PhotonMap &>(*globalMapPtr)
+                .save(photonCachePath(photonOptions.cacheDir, globalCacheLabel.c_str(),
+                                      photonBudgetTag(budget.globalEmitted, budget.globalStored)));
+        }
+    }
+    PhotonMapBackend &causticMap = *causticMapPtr;
+    PhotonMapBackend &globalMap = *globalMapPtr;
+    causticMap.setApproximation(photonOptions.causticEpsilon);
+    globalMap.setApproximation(photonOptions.globalEpsilon);
+    causticMap.setCancelFlag(&cancelPhotonTracing);
+    globalMap.setCancelFlag(&cancelPhotonTracing);
+
+    if (cancelPhotonTracing)
+        return CpuPhotonMaps();
+    photonBuildStage = "precomputing irradiance";
+    auto irradianceStart = std::chrono::steady_clock::now();
+    globalMap.precomputeIrradiance(IRRADIANCE_PHOTON_STRIDE, INITIAL_RADIUS);
+    double irradianceMs = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - irradianceStart)
+                              .count();
+    std::cout << "  global irradiance photons: " << globalMap.irradianceSize() << " in "
+              << irradianceMs << " ms\n";
+
+    if (cancelPhotonTracing)
+        return CpuPhotonMaps();
+    photonBuildStage = "replicating";
+    if (photonOptions.numaReplicate || photonOptions.hugePages != HugePageMode::Off)
+    {
+        replicatePhotonMap(causticMap, "caustic", photonOptions);
+        replicatePhotonMap(globalMap, "global", photonOptions);
+    }
+
+    if (cancelPhotonTracing)
+        return CpuPhotonMaps();
+    photonBuildStage = "timing lookups";
+    std::vector<Vec3> gatherPoints = sampleGatherPoints(camera, 20000, rng);
+    std::cout << "  caustic lookup: " << timePhotonLookups(causticMap, gatherPoints, CAUSTIC_RADIUS)
+              << " ns/query\n";
+    std::cout << "  global lookup: " << timePhotonLookups(globalMap, gatherPoints, INITIAL_RADIUS)
+              << " ns/query\n";
+#ifdef PHOTON_STATS
+    reportPhotonStats(causticMap, "caustic");
+    reportPhotonStats(globalMap, "global");
+#endif
+    reportPageCache(causticMap, "caustic");
+    reportPageCache(globalMap, "global");
+    std::cout << "=== Photon maps ready! ===\n";
+
+    CpuPhotonMaps maps;
+    maps.caustic = std::move(causticMapPtr);
+    maps.global = std::move(globalMapPtr);
+    return maps;
+}
+
+int main(int argc, char **argv)
+{
+    PhotonOptions photonOptions;
+    if (!parseOptions(argc, argv, photonOptions))
+        return -1;
+    if (photonOptions.benchLayout)
+        return runLayoutBenchmark();
+    if (photonOptions.benchApprox)
+        return runApproximationBenchmark();
+    if (photonOptions.benchCompact)
+        return runCompactBenchmark();
+
     if (!glfwInit())
     {
         std::cerr << "Failed to initialize GLFW\n";
@@ -63,6 +509,7 @@ int main()
     bool cameraMoving = false;
     extern bool texturesEnabled;
     bool savePPMRequested = false;
+    bool costFrameSaved = false;
     g_deltaTime = &deltaTime;
     g_cameraMovedFlag = &cameraMovedFlag;
     g_cameraMoving_cpu = &cameraMoving;
@@ -70,10 +517,11 @@ int main()
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+    const char *windowTitle = "Cornell Box - GPU Monte Carlo [1] / CPU Jensen [2]";
     GLFWwindow *window = glfwCreateWindow(
         WIDTH,
         HEIGHT,
-        "Cornell Box - GPU Monte Carlo [1] / CPU Jensen [2]",
+        windowTitle,
         nullptr,
         nullptr);
     if (!window)
@@ -102,6 +550,7 @@ int main()
     std::cout << "  GPU mode: WASD + Space/Shift + mouse look\n";
     std::cout << "  CPU mode: WASD + Q/E + drag LMB to rotate\n";
     std::cout << "  T (CPU mode): toggle textures\n";
+    std::cout << "  B (CPU mode): toggle bucketed photon gather\n";
     std::cout << "  ESC: quit\n\n";
 
     // GPU MONTE CARLO RESOURCES
@@ -134,22 +583,18 @@ int main()
 
     glDisable(GL_DEPTH_TEST);
 
-    // CPU JENSEN PHOTON MAPPING RESOURCES
-    std::cout << "=== Loading Textures (CPU path) ===\n";
-    floorTexture.load("textures/checkerboard.ppm");
-    backWallTexture.load("textures/brick_wall.ppm");
-    ceilingTexture.load("textures/ceiling.ppm");
-    std::cout << "===================================\n";
-
-    std::cout << "=== Pre-computing Photon Maps (CPU path) ===\n";
-    PhotonMap causticMap, globalMap;
-    std::mt19937 rng(42);
-    tracePhotons(causticMap, globalMap, rng);
-    std::cout << "Balancing caustic photon map...\n";
-    causticMap.balance();
-    std::cout << "Balancing global photon map...\n";
-    globalMap.balance();
-    std::cout << "=== Photon maps ready! ===\n";
+    // The CPU modes' textures and photon maps are built on a worker thread,
+    // so GPU mode is interactive at once; modes 2 and 3 wait for them.
+    gatherPhotonCount = (int)photonOptions.gatherPhotons;
+    streamPhotonTracing = !photonOptions.scalarPhotons;
+    samplerType = photonOptions.sampler;
+    const CPUCamera startCamera = CPUCameraControl::camera;
+    auto photonBuildStart = std::chrono::steady_clock::now();
+    std::future<CpuPhotonMaps> pendingPhotonMaps =
+        std::async(std::launch::async, [photonOptions, startCamera]
+                   { return buildCpuPhotonMaps(photonOptions, startCamera); });
+    CpuPhotonMaps photonMaps;
+    int shownBuildSeconds = -1;
 
     float quadVertices[] = {
         -1.0f, 1.0f, 0.0f, 1.0f,
@@ -193,6 +638,7 @@ int main()
     glDeleteShader(fragmentShaderCPU);
 
     std::vector<unsigned char> frameData(WIDTH * HEIGHT * 3);
+    std::vector<PixelCost> pixelCosts;
 
     GLuint cpuTexture;
     glGenTextures(1, &cpuTexture);
@@ -208,15 +654,21 @@ int main()
     std::cout << "WASD: Move camera\n";
     std::cout << "Q/E: Move up/down\n";
     std::cout << "T: Toggle textures ON/OFF\n";
+    std::cout << "B: Toggle bucketed photon gather\n";
+    std::cout << "I: Toggle irradiance photons for indirect light\n";
+    std::cout << "R: Toggle fixed-radius photon gather\n";
+    std::cout << "V: Toggle van Emde Boas photon tree layout\n";
     std::cout << "1: GPU Monte Carlo\n";
     std::cout << "2: CPU Photon Mapping\n";
+    std::cout << "3: CPU gather-cost heatmap\n";
     std::cout << "ESC: Exit\n";
     std::cout << "===========================\n\n";
 
     enum RenderMode
     {
         MODE_GPU_MONTE_CARLO = 1,
-        MODE_CPU_JENSEN = 2
+        MODE_CPU_JENSEN = 2,
+        MODE_CPU_COST = 3
     };
 
     RenderMode currentMode = MODE_GPU_MONTE_CARLO;
@@ -238,10 +690,20 @@ int main()
 
         glfwPollEvents();
 
+        if (pendingPhotonMaps.valid() &&
+            pendingPhotonMaps.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            photonMaps = takePhotonMaps(pendingPhotonMaps);
+            glfwSetWindowTitle(window, photonMaps.caustic ? windowTitle
+                                                          : "Cornell Box - photon map build failed");
+            needsRenderCPU = true;
+        }
+
         // Mode switching
-        static bool prev1 = false, prev2 = false;
+        static bool prev1 = false, prev2 = false, prev3 = false;
         bool key1 = glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS;
         bool key2 = glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS;
+        bool key3 = glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS;
 
         if (key1 && !prev1 && currentMode != MODE_GPU_MONTE_CARLO)
         {
@@ -253,6 +715,7 @@ int main()
 
             glfwSetCursorPosCallback(window, mouse_callback);
             glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+            glfwSetWindowTitle(window, windowTitle);
 
             std::cout << "Switched to GPU Monte Carlo mode\n";
         }
@@ -269,8 +732,22 @@ int main()
 
             std::cout << "Switched to CPU Jensen Photon Mapping mode\n";
         }
+        if (key3 && !prev3 && currentMode != MODE_CPU_COST)
+        {
+            glfwSetWindowSize(window, 400, 400);
+
+            currentMode = MODE_CPU_COST;
+            needsRenderCPU = true;
+            cameraMoving = true;
+
+            glfwSetCursorPosCallback(window, cpu_cursor_callback);
+            glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+
+            std::cout << "Switched to CPU gather-cost heatmap mode\n";
+        }
         prev1 = key1;
         prev2 = key2;
+        prev3 = key3;
 
         if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
         {
@@ -324,10 +801,34 @@ int main()
                 std::cout << "GPU Monte Carlo samples: " << frameCount << "\r" << std::flush;
             }
         }
+        // CPU MODES BEFORE THE PHOTON MAPS ARE READY, OR IF THEIR BUILD FAILED
+        else if (!photonMaps.caustic)
+        {
+            // Retitled once a second with the builder's current step; a failed
+            // build keeps the title set when it finished.
+            int seconds = (int)std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - photonBuildStart)
+                              .count();
+            if (pendingPhotonMaps.valid() && seconds != shownBuildSeconds)
+            {
+                shownBuildSeconds = seconds;
+                std::string title = std::string("Cornell Box - building photon maps: ") +
+                                    photonBuildStage.load() + " (" + std::to_string(seconds) + " s)";
+                glfwSetWindowTitle(window, title.c_str());
+            }
+            glClear(GL_COLOR_BUFFER_BIT);
+        }
         // CPU JENSEN PHOTON MAPPING MODE
         else if (currentMode == MODE_CPU_JENSEN)
         {
+            PhotonMapBackend &causticMap = *photonMaps.caustic;
+            PhotonMapBackend &globalMap = *photonMaps.global;
             processInputCPU(window, deltaTime, cameraMoving, savePPMRequested);
+            if (vebGather)
+            {
+                ensureVebLayout(causticMap, "caustic");
+                ensureVebLayout(globalMap, "global");
+            }
 
             if (cameraMoving)
             {
@@ -336,39 +837,46 @@ int main()
 
             if (needsRenderCPU && !cameraMoving)
             {
-                constexpr float CAMERA_FOV = 40.0f;
-                float aspectRatio = static_cast<float>(WIDTH) / static_cast<float>(HEIGHT);
-                float scale = std::tan(CAMERA_FOV * 0.5f * PI / 180.0f);
+                auto frameStart = std::chrono::steady_clock::now();
+                const int tilesX = (WIDTH + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+                const int tilesY = (HEIGHT + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
 
 #pragma omp parallel for schedule(dynamic)
-                for (int y = 0; y < HEIGHT; y++)
+                for (int tile = 0; tile < tilesX * tilesY; tile++)
                 {
-                    for (int x = 0; x < WIDTH; x++)
-                    {
-                        std::mt19937 localRng(y * WIDTH + x + renderCountCPU * WIDTH * HEIGHT);
+                    int x0 = (tile % tilesX) * RENDER_TILE_SIZE;
+                    int y0 = (tile / tilesX) * RENDER_TILE_SIZE;
+                    int x1 = std::min(x0 + RENDER_TILE_SIZE, WIDTH);
+                    int y1 = std::min(y0 + RENDER_TILE_SIZE, HEIGHT);
 
-                        float px = ((static_cast<float>(x) + 0.5f) / WIDTH * 2.0f - 1.0f) * aspectRatio * scale;
-                        float py = ((static_cast<float>(y) + 0.5f) / HEIGHT * 2.0f - 1.0f) * scale;
+                    Vec3 tileColors[RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+                    renderTile(CPUCameraControl::camera, causticMap, globalMap,
+                               x0, y0, x1, y1, renderCountCPU, tileColors);
 
-                        Vec3 color = renderPixel(px, py, CPUCameraControl::camera, causticMap, globalMap, localRng);
-
-                        color.x = color.x / (1.0f + color.x);
-                        color.y = color.y / (1.0f + color.y);
-                        color.z = color.z / (1.0f + color.z);
-
-                        color.x = powf(color.x, 1.0f / 2.2f);
-                        color.y = powf(color.y, 1.0f / 2.2f);
-                        color.z = powf(color.z, 1.0f / 2.2f);
-
-                        auto clamp01 = [](float v)
+                    for (int y = y0; y < y1; y++)
+                    {
+                        for (int x = x0; x < x1; x++)
                         {
-                            return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
-                        };
-
-                        int idx = (y * WIDTH + x) * 3;
-                        frameData[idx + 0] = static_cast<unsigned char>(clamp01(color.x) * 255.0f);
-                        frameData[idx + 1] = static_cast<unsigned char>(clamp01(color.y) * 255.0f);
-                        frameData[idx + 2] = static_cast<unsigned char>(clamp01(color.z) * 255.0f);
+                            Vec3 color = tileColors[(y - y0) * (x1 - x0) + (x - x0)];
+
+                            color.x = color.x / (1.0f + color.x);
+                            color.y = color.y / (1.0f + color.y);
+                            color.z = color.z / (1.0f + color.z);
+
+                            color.x = powf(color.x, 1.0f / 2.2f);
+                            color.y = powf(color.y, 1.0f / 2.2f);
+                            color.z = powf(color.z, 1.0f / 2.2f);
+
+                            auto clamp01 = [](float v)
+                            {
+                                return v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+                            };
+
+                            int idx = (y * WIDTH + x) * 3;
+                            frameData[idx + 0] = static_cast<unsigned char>(clamp01(color.x) * 255.0f);
+                            frameData[idx + 1] = static_cast<unsigned char>(clamp01(color.y) * 255.0f);
+                            frameData[idx + 2] = static_cast<unsigned char>(clamp01(color.z) * 255.0f);
+                        }
                     }
                 }
 
@@ -379,7 +887,16 @@ int main()
                 needsRenderCPU = false;
                 renderCountCPU++;
 
-                std::cout << "CPU Jensen frame: " << renderCountCPU << "\n";
+                double frameMs = std::chrono::duration<double, std::milli>(
+                                     std::chrono::steady_clock::now() - frameStart)
+                                     .count();
+                std::cout << "CPU Jensen frame: " << renderCountCPU << " (" << frameMs << " ms)\n";
+                reportPageCache(causticMap, "caustic");
+                reportPageCache(globalMap, "global");
+#ifdef PHOTON_STATS
+                reportPhotonStats(causticMap, "caustic");
+                reportPhotonStats(globalMap, "global");
+#endif
                 if (renderCountCPU == 1 || savePPMRequested)
                 {
                     std::string filename = (renderCountCPU == 1) ? "cornell_box_demo.ppm" : "cornell_box_frame.ppm";
@@ -396,11 +913,74 @@ int main()
             glUniform1i(glGetUniformLocation(shaderProgramCPU, "screenTexture"), 0);
             glDrawArrays(GL_TRIANGLES, 0, 6);
         }
+        // CPU GATHER-COST HEATMAP MODE
+        else if (currentMode == MODE_CPU_COST)
+        {
+            PhotonMapBackend &causticMap = *photonMaps.caustic;
+            PhotonMapBackend &globalMap = *photonMaps.global;
+            processInputCPU(window, deltaTime, cameraMoving, savePPMRequested);
+            if (vebGather)
+            {
+                ensureVebLayout(causticMap, "caustic");
+                ensureVebLayout(globalMap, "global");
+            }
+
+            if (cameraMoving)
+            {
+                needsRenderCPU = true;
+            }
+
+            if (needsRenderCPU && !cameraMoving)
+            {
+                auto frameStart = std::chrono::steady_clock::now();
+                renderCostFrame(CPUCameraControl::camera, causticMap, globalMap, renderCountCPU,
+                                pixelCosts);
+                costHeatmap(pixelCosts, frameData);
+
+                glBindTexture(GL_TEXTURE_2D, cpuTexture);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT,
+                                GL_RGB, GL_UNSIGNED_BYTE, frameData.data());
+
+                needsRenderCPU = false;
+                renderCountCPU++;
+
+                double frameMs = std::chrono::duration<double, std::milli>(
+                                     std::chrono::steady_clock::now() - frameStart)
+                                     .count();
+                std::cout << "CPU cost frame: " << renderCountCPU << " (" << frameMs << " ms)\n";
+#ifdef PHOTON_STATS
+                reportPhotonStats(causticMap, "caustic");
+                reportPhotonStats(globalMap, "global");
+#endif
+                // Saved for the first cost frame and when P asks, not at every camera stop.
+                if (!costFrameSaved || savePPMRequested)
+                {
+                    savePPM(frameData, WIDTH, HEIGHT, "cornell_box_cost.ppm");
+                    saveCostBuffer(pixelCosts, WIDTH, HEIGHT, "cornell_box_cost.raw");
+                    costFrameSaved = true;
+                    savePPMRequested = false;
+                }
+            }
+
+            glClear(GL_COLOR_BUFFER_BIT);
+            glUseProgram(shaderProgramCPU);
+            glBindVertexArray(quadVAO_CPU);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, cpuTexture);
+            glUniform1i(glGetUniformLocation(shaderProgramCPU, "screenTexture"), 0);
+            glDrawArrays(GL_TRIANGLES, 0, 6);
+        }
 
         glfwSwapBuffers(window);
     }
 
     // CLEANUP
+    if (pendingPhotonMaps.valid())
+    {
+        std::cout << "Cancelling the photon map build...\n";
+        cancelPhotonTracing = true;
+        takePhotonMaps(pendingPhotonMaps);
+    }
     glDeleteVertexArrays(1, &fsqVAO_GPU);
     glDeleteTextures(1, &accumTex);
     glDeleteTextures(1, &rayTex);
@@ -0,0 +1,51 @@
+#include "renderer/photon_backend.h"
+
+std::unique_ptr<PhotonMapBackend> createPhotonMap(PhotonBackendType type, float gatherRadius,
+                                                  const std::string &spillDirectory,
+                                                  size_t cacheBytes)
+{
+    switch (type)
+    {
+    case PhotonBackendType::HashGrid:
+        return std::make_unique<PhotonHashGrid>(gatherRadius);
+    case PhotonBackendType::Incremental:
+        return std::make_unique<IncrementalPhotonMap>();
+    case PhotonBackendType::OutOfCore:
+        return std::make_unique<OutOfCorePhotonMap>(spillDirectory, cacheBytes);
+    case PhotonBackendType::Surface:
+        return std::make_unique<SurfacePhotonMap>();
+    case PhotonBackendType::KdTree:
+    default:
+        return std::make_unique<PhotonMap>();
+    }
+}
+
+bool parsePhotonBackendType(const std::string &name, PhotonBackendType &type)
+{
+    if (name == "kdtree")
+    {
+        type = PhotonBackendType::KdTree;
+        return true;
+    }
+    if (name == "grid")
+    {
+        type = PhotonBackendType::HashGrid;
+        return true;
+    }
+    if (name == "incremental")
+    {
+        type = PhotonBackendType::Incremental;
+        return true;
+    }
+    if (name == "outofcore")
+    {
+        type = PhotonBackendType::OutOfCore;
+        return true;
+    }
+    if (name == "surface")
+    {
+        type = PhotonBackendType::Surface;
+        return true;
+    }
+    return false;
+}
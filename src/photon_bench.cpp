@@ -0,0 +1,293 @@
+#include "renderer/photon_bench.h"
+#include "renderer/compact_photon_map.h"
+#include "renderer/photon_map.h"
+#include "renderer/renderer_cpu.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace
+{
+const float BOX_SIZE = 555.0f;
+const int BENCH_QUERIES = 200000;
+
+// Uniform point near one of the six walls of the Cornell box, up to
+// `thickness` off the plane. Points exactly on the planes would tie with the
+// splits along the wall normal and measure that degenerate case instead of
+// the memory layout.
+Vec3 randomWallPoint(std::mt19937 &rng, float thickness)
+{
+    std::uniform_real_distribution<float> coord(0.0f, BOX_SIZE);
+    std::uniform_real_distribution<float> offset(0.0f, thickness);
+    std::uniform_int_distribution<int> wall(0, 5);
+    int w = wall(rng);
+    float a = coord(rng), b = coord(rng);
+    float c = (w & 1) ? BOX_SIZE - offset(rng) : offset(rng);
+    switch (w / 2)
+    {
+    case 0:
+        return Vec3(c, a, b);
+    case 1:
+        return Vec3(a, c, b);
+    default:
+        return Vec3(a, b, c);
+    }
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename Locate>
+double timeQueries(const std::vector<Vec3> &queries, float radius, double &checksum, Locate locate)
+{
+    checksum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (const Vec3 &q : queries)
+    {
+        PhotonHeap heap;
+        float maxDistSq = radius * radius;
+        locate(q, maxDistSq, heap);
+        checksum += heap.empty() ? 0.0 : heap.maxDistSq();
+    }
+    return elapsedMs(start) * 1e6 / queries.size();
+}
+
+const float BENCH_EPSILONS[] = {0.0f, 0.1f, 0.25f, 0.5f, 1.0f, 2.0f};
+const int APPROX_QUERIES = 20000;
+
+double densityEstimate(const PhotonHeap &heap, float maxDistSq)
+{
+    double power = 0.0;
+    for (int i = 0; i < heap.size(); i++)
+    {
+        const Vec3 &p = heap.entries[i].photon->power;
+        power += (p.x + p.y + p.z) / 3.0;
+    }
+    return power / (3.14159265 * maxDistSq);
+}
+
+void benchmarkApproximation(PhotonMap &map, const char *label, const std::vector<Vec3> &queries,
+                            float radius)
+{
+    std::vector<PhotonHeap> exact(queries.size());
+    std::vector<float> exactDistSq(queries.size());
+    for (size_t i = 0; i < queries.size(); i++)
+    {
+        exactDistSq[i] = radius * radius;
+        map.locatePhotons(queries[i], MAX_GATHER_PHOTONS, exactDistSq[i], exact[i]);
+    }
+
+    std::printf("%s map (%zu photons)\n", label, map.size());
+    std::printf("%8s %12s %8s %12s %10s %10s\n", "epsilon", "ns/query", "speedup", "radius ratio",
+                "recall", "est. err");
+    double exactNs = 0.0;
+    for (float epsilon : BENCH_EPSILONS)
+    {
+        map.setApproximation(epsilon);
+        double checksum;
+        double ns = timeQueries(queries, radius, checksum,
+                                [&](const Vec3 &q, float &maxDistSq, PhotonHeap &heap)
+                                {
+                                    map.locatePhotons(q, MAX_GATHER_PHOTONS, maxDistSq, heap);
+                                });
+        if (epsilon == 0.0f)
+            exactNs = ns;
+
+        double radiusRatio = 0.0, recall = 0.0, error = 0.0;
+        int compared = 0;
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+            if (exact[i].empty())
+                continue;
+            PhotonHeap heap;
+            float maxDistSq = radius * radius;
+            map.locatePhotons(queries[i], MAX_GATHER_PHOTONS, maxDistSq, heap);
+
+            int shared = 0;
+            for (int a = 0; a < heap.size(); a++)
+            {
+                for (int b = 0; b < exact[i].size(); b++)
+                {
+                    if (heap.entries[a].photon == exact[i].entries[b].photon)
+                    {
+                        shared++;
+                        break;
+                    }
+                }
+            }
+            double reference = densityEstimate(exact[i], exactDistSq[i]);
+            radiusRatio += std::sqrt(maxDistSq / exactDistSq[i]);
+            recall += (double)shared / exact[i].size();
+            error += std::fabs(densityEstimate(heap, maxDistSq) - reference) / reference;
+            compared++;
+        }
+        compared = std::max(compared, 1);
+        std::printf("%8.2f %12.1f %8.2f %12.4f %9.1f%% %9.2f%%\n", epsilon, ns, exactNs / ns,
+                    radiusRatio / compared, 100.0 * recall / compared, 100.0 * error / compared);
+    }
+    map.setApproximation(0.0f);
+}
+
+void benchmarkCompact(const PhotonMap &map, const char *label, const std::vector<Vec3> &queries,
+                      float radius)
+{
+    CompactPhotonMap compact;
+    compact.photons.reserve(map.size());
+    for (const Photon &p : map.photons)
+        compact.store(p.position, p.power, p.incomingDir);
+    compact.balance();
+
+    double fullSum;
+    double fullNs = timeQueries(queries, radius, fullSum,
+                                [&](const Vec3 &q, float &maxDistSq, PhotonHeap &heap)
+                                {
+                                    map.locatePhotons(q, MAX_GATHER_PHOTONS, maxDistSq, heap);
+                                });
+
+    auto start = std::chrono::steady_clock::now();
+    double compactSum = 0.0;
+    for (const Vec3 &q : queries)
+    {
+        CompactPhotonHeap heap;
+        float maxDistSq = radius * radius;
+        compact.locatePhotons(q, MAX_GATHER_PHOTONS, maxDistSq, heap);
+        compactSum += heap.empty() ? 0.0 : heap.maxDistSq();
+    }
+    double compactNs = elapsedMs(start) * 1e6 / queries.size();
+
+    // Both trees hold the same positions, so the gathers differ only in the
+    // decoded power and direction.
+    double error = 0.0, directionError = 0.0;
+    int compared = 0;
+    for (const Vec3 &q : queries)
+    {
+        PhotonHeap full;
+        CompactPhotonHeap packed;
+        float fullDistSq = radius * radius, packedDistSq = radius * radius;
+        map.locatePhotons(q, MAX_GATHER_PHOTONS, fullDistSq, full);
+        compact.locatePhotons(q, MAX_GATHER_PHOTONS, packedDistSq, packed);
+        if (full.empty())
+            continue;
+
+        double reference = densityEstimate(full, fullDistSq);
+        double power = 0.0;
+        for (int i = 0; i < packed.size(); i++)
+        {
+            Vec3 p = packed.entries[i].photon->decodePower();
+            power += (p.x + p.y + p.z) / 3.0;
+        }
+        double estimate = power / (3.14159265 * packedDistSq);
+        error += std::fabs(estimate - reference) / reference;
+
+        double angle = 0.0;
+        for (int i = 0; i < packed.size(); i++)
+        {
+            const CompactPhoton &p = *packed.entries[i].photon;
+            float bestCos = -1.0f;
+            for (int j = 0; j < full.size(); j++)
+            {
+                if (full.entries[j].photon->position.x == p.position.x &&
+                    full.entries[j].photon->position.y == p.position.y &&
+                    full.entries[j].photon->position.z == p.position.z)
+                    bestCos = full.entries[j].photon->incomingDir.dot(p.decodeDirection());
+            }
+            angle += std::acos(std::min(1.0f, std::max(-1.0f, bestCos)));
+        }
+        directionError += packed.empty() ? 0.0 : angle / packed.size();
+        compared++;
+    }
+    compared = std::max(compared, 1);
+
+    std::printf("%-8s %9zu %8zu %8zu %10.1f %10.1f %8s %9.3f%% %10.3f\n", label, map.size(),
+                sizeof(Photon), sizeof(CompactPhoton), fullNs, compactNs,
+                fullSum == compactSum ? "yes" : "NO", 100.0 * error / compared,
+                directionError / compared * 180.0 / 3.14159265);
+}
+}
+
+int runLayoutBenchmark()
+{
+    const size_t sizes[] = {30000, 1000000, 10000000};
+
+    std::printf("%10s %12s %12s %14s %14s %8s\n", "photons", "balance ms", "veb ms",
+                "heap ns/query", "veb ns/query", "match");
+    for (size_t n : sizes)
+    {
+        std::mt19937 rng(1234);
+        float density = n / (6.0f * BOX_SIZE * BOX_SIZE);
+        float spacing = 1.0f / std::sqrt(density);
+
+        PhotonMap map;
+        map.reserve(n);
+        for (size_t i = 0; i < n; i++)
+            map.store(randomWallPoint(rng, spacing), Vec3(1, 1, 1), Vec3(0, 1, 0), Vec3(0, 1, 0), -1);
+
+        auto start = std::chrono::steady_clock::now();
+        map.balance();
+        double balanceMs = elapsedMs(start);
+
+        start = std::chrono::steady_clock::now();
+        map.buildVebLayout();
+        double vebMs = elapsedMs(start);
+
+        std::vector<Vec3> queries(BENCH_QUERIES);
+        for (Vec3 &q : queries)
+            q = randomWallPoint(rng, spacing);
+
+        // Large enough that most queries fill their heap of MAX_GATHER_PHOTONS.
+        float radius = std::sqrt(4.0f * MAX_GATHER_PHOTONS / (3.14159265f * density));
+
+        double heapSum, vebSum;
+        double heapNs = timeQueries(queries, radius, heapSum,
+                                    [&](const Vec3 &q, float &maxDistSq, PhotonHeap &heap)
+                                    {
+                                        map.locatePhotons(q, MAX_GATHER_PHOTONS, maxDistSq, heap);
+                                    });
+        double vebNs = timeQueries(queries, radius, vebSum,
+                                   [&](const Vec3 &q, float &maxDistSq, PhotonHeap &heap)
+                                   {
+                                       map.locatePhotonsVeb(q, MAX_GATHER_PHOTONS, maxDistSq, heap);
+                                   });
+
+        std::printf("%10zu %12.1f %12.1f %14.1f %14.1f %8s\n", n, balanceMs, vebMs, heapNs, vebNs,
+                    heapSum == vebSum ? "yes" : "NO");
+    }
+    return 0;
+}
+
+int runApproximationBenchmark()
+{
+    PhotonMap causticMap, globalMap;
+    tracePhotons(causticMap, globalMap, 1234);
+    std::mt19937 rng(1234);
+    causticMap.balance();
+    globalMap.balance();
+
+    CPUCamera camera;
+    std::vector<Vec3> queries = sampleGatherPoints(camera, APPROX_QUERIES, rng);
+    benchmarkApproximation(globalMap, "global", queries, INITIAL_RADIUS);
+    benchmarkApproximation(causticMap, "caustic", queries, CAUSTIC_RADIUS);
+    return 0;
+}
+
+int runCompactBenchmark()
+{
+    PhotonMap causticMap, globalMap;
+    tracePhotons(causticMap, globalMap, 1234);
+    std::mt19937 rng(1234);
+    causticMap.balance();
+    globalMap.balance();
+
+    CPUCamera camera;
+    std::vector<Vec3> queries = sampleGatherPoints(camera, APPROX_QUERIES, rng);
+    std::printf("%-8s %9s %8s %8s %10s %10s %8s %10s %10s\n", "map", "photons", "B full",
+                "B comp", "full ns", "comp ns", "same r", "est. err", "dir. err");
+    benchmarkCompact(globalMap, "global", queries, INITIAL_RADIUS);
+    benchmarkCompact(causticMap, "caustic", queries, CAUSTIC_RADIUS);
+    return 0;
+}
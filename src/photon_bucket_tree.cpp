@@ -0,0 +1,219 @@
+#include "renderer/photon_bucket_tree.h"
+#include "renderer/photon_map.h"
+#include <algorithm>
+#include <numeric>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+// Padding slots sit far outside the scene so they never pass the radius test.
+const float PAD_COORD = 1e30f;
+}
+
+void PhotonBucketTree::clear()
+{
+    nodes.clear();
+    xs.clear();
+    ys.clear();
+    zs.clear();
+    photonIndex.clear();
+}
+
+void PhotonBucketTree::build(const std::vector<Photon> &photons)
+{
+    clear();
+    if (photons.empty())
+        return;
+
+    std::vector<uint32_t> indices(photons.size());
+    std::iota(indices.begin(), indices.end(), 0u);
+
+    nodes.reserve(2 * photons.size() / (PHOTON_BUCKET_SIZE / 2) + 1);
+    size_t slots = photons.size() + photons.size() / (PHOTON_BUCKET_SIZE / 2) * PHOTON_BUCKET_LANES;
+    xs.reserve(slots);
+    ys.reserve(slots);
+    zs.reserve(slots);
+    photonIndex.reserve(slots);
+
+    buildNode(photons, indices, 0, indices.size());
+}
+
+uint32_t PhotonBucketTree::buildNode(const std::vector<Photon> &photons,
+                                     std::vector<uint32_t> &indices,
+                                     size_t start, size_t end)
+{
+    uint32_t nodeIndex = (uint32_t)nodes.size();
+    nodes.push_back(Node());
+
+    if (end - start <= (size_t)PHOTON_BUCKET_SIZE)
+    {
+        Node &leaf = nodes[nodeIndex];
+        leaf.axis = -1;
+        leaf.split = 0.0f;
+        leaf.rightChild = 0;
+        leaf.first = (uint32_t)xs.size();
+        leaf.count = (uint32_t)(end - start);
+
+        for (size_t i = start; i < end; i++)
+        {
+            const Photon &p = photons[indices[i]];
+            xs.push_back(p.position.x);
+            ys.push_back(p.position.y);
+            zs.push_back(p.position.z);
+            photonIndex.push_back(indices[i]);
+        }
+        while (xs.size() % PHOTON_BUCKET_LANES != 0)
+        {
+            xs.push_back(PAD_COORD);
+            ys.push_back(PAD_COORD);
+            zs.push_back(PAD_COORD);
+            photonIndex.push_back(0);
+        }
+        return nodeIndex;
+    }
+
+    Vec3 bboxMin(1e30f, 1e30f, 1e30f);
+    Vec3 bboxMax(-1e30f, -1e30f, -1e30f);
+    for (size_t i = start; i < end; i++)
+    {
+        const Vec3 &p = photons[indices[i]].position;
+        bboxMin = Vec3(std::min(bboxMin.x, p.x), std::min(bboxMin.y, p.y), std::min(bboxMin.z, p.z));
+        bboxMax = Vec3(std::max(bboxMax.x, p.x), std::max(bboxMax.y, p.y), std::max(bboxMax.z, p.z));
+    }
+
+    Vec3 extent = bboxMax - bboxMin;
+    int axis = 0;
+    if (extent.y > extent.x && extent.y > extent.z)
+        axis = 1;
+    else if (extent.z > extent.x && extent.z > extent.y)
+        axis = 2;
+
+    size_t mid = (start + end) / 2;
+    std::nth_element(indices.begin() + start, indices.begin() + mid,
+                     indices.begin() + end,
+                     [&photons, axis](uint32_t a, uint32_t b)
+                     {
+                         return photons[a].position[axis] < photons[b].position[axis];
+                     });
+    float split = photons[indices[mid]].position[axis];
+
+    // Everything left of mid is <= split and everything from mid on is >= split.
+    buildNode(photons, indices, start, mid);
+    uint32_t right = buildNode(photons, indices, mid, end);
+
+    Node &node = nodes[nodeIndex];
+    node.axis = axis;
+    node.split = split;
+    node.rightChild = right;
+    node.first = 0;
+    node.count = 0;
+    return nodeIndex;
+}
+
+void PhotonBucketTree::locatePhotons(const Photon *photons, const Vec3 &pos, int maxPhotons,
+                                     float &maxDistSq, BasicPhotonHeap<Photon> &heap,
+                                     float farScaleSq, PhotonQueryStats *stats) const
+{
+    (void)stats;
+    if (nodes.empty())
+        return;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+
+    struct StackEntry
+    {
+        uint32_t node;
+        float planeDistSq;
+    };
+    StackEntry stack[PHOTON_STACK_DEPTH];
+    int stackSize = 0;
+
+    alignas(32) float distSq[PHOTON_BUCKET_LANES];
+    uint32_t nodeIndex = 0;
+
+    while (true)
+    {
+        const Node *node = &nodes[nodeIndex];
+        while (node->axis >= 0)
+        {
+            PHOTON_STAT(if (stats) stats->nodesVisited++);
+            float delta = pos[node->axis] - node->split;
+            uint32_t nearChild = (delta < 0) ? nodeIndex + 1 : node->rightChild;
+            uint32_t farChild = (delta < 0) ? node->rightChild : nodeIndex + 1;
+
+            stack[stackSize].node = farChild;
+            stack[stackSize].planeDistSq = delta * delta * farScaleSq;
+            stackSize++;
+
+            nodeIndex = nearChild;
+            node = &nodes[nodeIndex];
+        }
+
+        // Leaf: test all of its photons in fixed-width lane groups.
+        PHOTON_STAT(if (stats) { stats->nodesVisited++; stats->distanceTests += node->count; });
+        const uint32_t first = node->first;
+        const uint32_t padded = (node->count + PHOTON_BUCKET_LANES - 1) & ~(uint32_t)(PHOTON_BUCKET_LANES - 1);
+        for (uint32_t base = 0; base < padded; base += PHOTON_BUCKET_LANES)
+        {
+            const uint32_t s = first + base;
+            unsigned mask;
+#if defined(__AVX2__)
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&xs[s]), _mm256_set1_ps(pos.x));
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&ys[s]), _mm256_set1_ps(pos.y));
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&zs[s]), _mm256_set1_ps(pos.z));
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                     _mm256_mul_ps(dz, dz));
+            _mm256_store_ps(distSq, d);
+            mask = (unsigned)_mm256_movemask_ps(_mm256_cmp_ps(d, _mm256_set1_ps(maxDistSq), _CMP_LT_OQ));
+#elif defined(__SSE2__)
+            mask = 0;
+            for (int half = 0; half < PHOTON_BUCKET_LANES; half += 4)
+            {
+                __m128 dx = _mm_sub_ps(_mm_loadu_ps(&xs[s + half]), _mm_set1_ps(pos.x));
+                __m128 dy = _mm_sub_ps(_mm_loadu_ps(&ys[s + half]), _mm_set1_ps(pos.y));
+                __m128 dz = _mm_sub_ps(_mm_loadu_ps(&zs[s + half]), _mm_set1_ps(pos.z));
+                __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                                      _mm_mul_ps(dz, dz));
+                _mm_store_ps(distSq + half, d);
+                mask |= (unsigned)_mm_movemask_ps(_mm_cmplt_ps(d, _mm_set1_ps(maxDistSq))) << half;
+            }
+#else
+            mask = 0;
+            for (int lane = 0; lane < PHOTON_BUCKET_LANES; lane++)
+            {
+                float dx = xs[s + lane] - pos.x;
+                float dy = ys[s + lane] - pos.y;
+                float dz = zs[s + lane] - pos.z;
+                distSq[lane] = dx * dx + dy * dy + dz * dz;
+                if (distSq[lane] < maxDistSq)
+                    mask |= 1u << lane;
+            }
+#endif
+            while (mask)
+            {
+                int lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+                // The radius may have shrunk since the lane mask was computed.
+                if (distSq[lane] < maxDistSq)
+                    heap.push(distSq[lane], &photons[photonIndex[s + lane]], maxPhotons, maxDistSq);
+            }
+        }
+
+        bool resumed = false;
+        while (stackSize > 0)
+        {
+            const StackEntry &e = stack[--stackSize];
+            if (e.planeDistSq < maxDistSq)
+            {
+                PHOTON_STAT(if (stats) stats->farDescents++);
+                nodeIndex = e.node;
+                resumed = true;
+                break;
+            }
+        }
+        if (!resumed)
+            break;
+    }
+}
@@ -0,0 +1,51 @@
+#include "renderer/photon_direction.h"
+#include <cmath>
+#include <algorithm>
+
+namespace
+{
+const float PI_F = 3.14159265359f;
+
+// Decoding goes through tables so a lookup never calls sin/cos.
+struct DirectionTables
+{
+    float sinTheta[256], cosTheta[256];
+    float sinPhi[256], cosPhi[256];
+
+    DirectionTables()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            float angle = (i + 0.5f) * (PI_F / 256.0f);
+            sinTheta[i] = std::sin(angle);
+            cosTheta[i] = std::cos(angle);
+            sinPhi[i] = std::sin(2.0f * angle);
+            cosPhi[i] = std::cos(2.0f * angle);
+        }
+    }
+};
+
+const DirectionTables &directionTables()
+{
+    static const DirectionTables tables;
+    return tables;
+}
+}
+
+void encodePhotonDirection(const Vec3 &d, unsigned char &theta, unsigned char &phi)
+{
+    int t = (int)(std::acos(std::clamp(d.z, -1.0f, 1.0f)) * (256.0f / PI_F));
+    int p = (int)(std::atan2(d.y, d.x) * (256.0f / (2.0f * PI_F)));
+    if (p < 0)
+        p += 256;
+    theta = (unsigned char)std::min(t, 255);
+    phi = (unsigned char)std::min(p, 255);
+}
+
+Vec3 decodePhotonDirection(unsigned char theta, unsigned char phi)
+{
+    const DirectionTables &t = directionTables();
+    return Vec3(t.sinTheta[theta] * t.cosPhi[phi],
+                t.sinTheta[theta] * t.sinPhi[phi],
+                t.cosTheta[theta]);
+}
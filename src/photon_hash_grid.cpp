@@ -0,0 +1,118 @@
+#include "renderer/photon_hash_grid.h"
+#include "renderer/photon_direction.h"
+#include <algorithm>
+#include <cmath>
+
+// Queries touching more cells than this fall back to a linear scan.
+static const int MAX_QUERY_CELLS = 64;
+
+PhotonHashGrid::PhotonHashGrid(float cellSize)
+    : cellSize(cellSize), invCellSize(1.0f / cellSize)
+{
+}
+
+void PhotonHashGrid::store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+                           const Vec3 &normal, int /*primitive*/)
+{
+    Photon p;
+    p.position = pos;
+    p.power = power;
+    p.incomingDir = inDir;
+    p.axis = 0;
+    encodePhotonDirection(normal, p.normalTheta, p.normalPhi);
+    photons.push_back(p);
+}
+
+void PhotonHashGrid::scalePower(float factor)
+{
+    for (Photon &p : photons)
+        p.power = p.power * factor;
+}
+
+int PhotonHashGrid::cellCoord(float x) const
+{
+    return (int)std::floor(x * invCellSize);
+}
+
+uint32_t PhotonHashGrid::cellHash(int x, int y, int z) const
+{
+    return (((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u)) & tableMask;
+}
+
+void PhotonHashGrid::balance()
+{
+    cellStart.clear();
+    if (photons.empty())
+        return;
+
+    uint32_t tableSize = 1;
+    while (tableSize < 2 * photons.size())
+        tableSize <<= 1;
+    tableMask = tableSize - 1;
+
+    std::vector<uint32_t> hashes(photons.size());
+    cellStart.assign(tableSize + 1, 0);
+    for (size_t i = 0; i < photons.size(); i++)
+    {
+        const Vec3 &p = photons[i].position;
+        hashes[i] = cellHash(cellCoord(p.x), cellCoord(p.y), cellCoord(p.z));
+        cellStart[hashes[i] + 1]++;
+    }
+    for (uint32_t h = 0; h < tableSize; h++)
+        cellStart[h + 1] += cellStart[h];
+
+    std::vector<uint32_t> next(cellStart.begin(), cellStart.end() - 1);
+    std::vector<Photon> sorted(photons.size());
+    for (size_t i = 0; i < photons.size(); i++)
+        sorted[next[hashes[i]]++] = photons[i];
+    photons = std::move(sorted);
+}
+
+void PhotonHashGrid::locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                   PhotonHeap &heap) const
+{
+    if (cellStart.empty())
+        return;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+
+    auto testRange = [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            float distSq = (pos - photons[i].position).lengthSq();
+            if (distSq < maxDistSq)
+                heap.push(distSq, &photons[i], maxPhotons, maxDistSq);
+        }
+    };
+
+    float r = std::sqrt(maxDistSq);
+    int x0 = cellCoord(pos.x - r), x1 = cellCoord(pos.x + r);
+    int y0 = cellCoord(pos.y - r), y1 = cellCoord(pos.y + r);
+    int z0 = cellCoord(pos.z - r), z1 = cellCoord(pos.z + r);
+
+    long long cells = (long long)(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+    if (cells > MAX_QUERY_CELLS)
+    {
+        testRange(0, (uint32_t)photons.size());
+        return;
+    }
+
+    // Distinct cells can share a bucket; scan each bucket only once.
+    uint32_t visited[MAX_QUERY_CELLS];
+    int visitedCount = 0;
+
+    for (int z = z0; z <= z1; z++)
+    {
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                uint32_t h = cellHash(x, y, z);
+                if (std::find(visited, visited + visitedCount, h) != visited + visitedCount)
+                    continue;
+                visited[visitedCount++] = h;
+                testRange(cellStart[h], cellStart[h + 1]);
+            }
+        }
+    }
+}
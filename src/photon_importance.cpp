@@ -0,0 +1,99 @@
+#include "renderer/photon_importance.h"
+#include "renderer/scene.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+// Direction at grid coordinates (u, v) in [0, IMPORTANCE_MAP_RESOLUTION]^2,
+// mapped as cosineWeightedHemisphere maps (r1, r2) about the light's -y normal.
+static Vec3 cellDirection(float u, float v)
+{
+    float phi = 2.0f * PI * u / IMPORTANCE_MAP_RESOLUTION;
+    float sinSq = std::min(v / IMPORTANCE_MAP_RESOLUTION, 1.0f);
+    float s = std::sqrt(sinSq);
+    return Vec3(std::cos(phi) * s, -std::sqrt(1.0f - sinSq), std::sin(phi) * s);
+}
+
+PhotonImportanceMap::PhotonImportanceMap(const Vec3 &lightCenter, float halfWidth, float halfDepth)
+    : corner(lightCenter - Vec3(halfWidth, 0.0f, halfDepth)),
+      patchWidth(2.0f * halfWidth / IMPORTANCE_MAP_PATCHES),
+      patchDepth(2.0f * halfDepth / IMPORTANCE_MAP_PATCHES),
+      importance(IMPORTANCE_MAP_PATCHES * IMPORTANCE_MAP_PATCHES *
+                     IMPORTANCE_MAP_RESOLUTION * IMPORTANCE_MAP_RESOLUTION,
+                 0.0)
+{
+}
+
+void PhotonImportanceMap::deposit(const Vec3 &origin, const Vec3 &direction, float value)
+{
+    const int res = IMPORTANCE_MAP_RESOLUTION;
+    int px = std::clamp((int)((origin.x - corner.x) / patchWidth), 0, IMPORTANCE_MAP_PATCHES - 1);
+    int pz = std::clamp((int)((origin.z - corner.z) / patchDepth), 0, IMPORTANCE_MAP_PATCHES - 1);
+
+    float phi = std::atan2(direction.z, direction.x);
+    if (phi < 0.0f)
+        phi += 2.0f * PI;
+    int cx = std::min((int)(phi / (2.0f * PI) * res), res - 1);
+    int cy = std::clamp((int)((1.0f - direction.y * direction.y) * res), 0, res - 1);
+
+    int patch = pz * IMPORTANCE_MAP_PATCHES + px;
+    importance[(size_t)patch * res * res + cy * res + cx] += value;
+}
+
+void PhotonImportanceMap::finalize()
+{
+    double total = 0.0;
+    for (double w : importance)
+        total += w;
+
+    // With nothing deposited the emission stays uniform.
+    double uniformShare = total > 0.0 ? IMPORTANCE_MAP_UNIFORM_SHARE : 1.0;
+    double uniform = uniformShare / importance.size();
+    double learned = total > 0.0 ? (1.0 - uniformShare) / total : 0.0;
+
+    cdf.resize(importance.size());
+    double sum = 0.0;
+    for (size_t i = 0; i < importance.size(); i++)
+    {
+        sum += uniform + learned * importance[i];
+        cdf[i] = sum;
+    }
+}
+
+void PhotonImportanceMap::sample(PhotonSampler &sampler, Vec3 &origin, Vec3 &direction,
+                                 float &weight) const
+{
+    const int res = IMPORTANCE_MAP_RESOLUTION;
+    double pick = sampler.get(0) * cdf.back();
+    size_t bin = std::min((size_t)(std::upper_bound(cdf.begin(), cdf.end(), pick) - cdf.begin()),
+                          cdf.size() - 1);
+    double probability = cdf[bin] - (bin > 0 ? cdf[bin - 1] : 0.0);
+
+    int patch = (int)(bin / (res * res));
+    int cell = (int)(bin % (res * res));
+    float originU = sampler.get(1);
+    float originV = sampler.get(2);
+    origin = corner + Vec3((patch % IMPORTANCE_MAP_PATCHES + originU) * patchWidth, 0.0f,
+                           (patch / IMPORTANCE_MAP_PATCHES + originV) * patchDepth);
+
+    float u = cell % res + sampler.get(3);
+    float v = cell / res + sampler.get(4);
+    direction = cellDirection(u, v);
+
+    weight = (float)(cdf.back() / cdf.size() / probability);
+}
+
+int PhotonImportanceMap::binsHolding(float fraction) const
+{
+    std::vector<double> sorted(importance);
+    std::sort(sorted.begin(), sorted.end(), std::greater<double>());
+    double total = 0.0;
+    for (double w : sorted)
+        total += w;
+
+    double sum = 0.0;
+    int bins = 0;
+    while (bins < (int)sorted.size() && sum < fraction * total)
+        sum += sorted[bins++];
+    return bins;
+}
@@ -0,0 +1,67 @@
+#include "renderer/photon_incremental.h"
+#include "renderer/photon_direction.h"
+#include <algorithm>
+
+void IncrementalPhotonMap::store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+                                 const Vec3 &normal, int /*primitive*/)
+{
+    Photon p;
+    p.position = pos;
+    p.power = power;
+    p.incomingDir = inDir;
+    p.axis = 0;
+    encodePhotonDirection(normal, p.normalTheta, p.normalPhi);
+    photons.push_back(p);
+
+    if (photons.size() - tailStart >= INCREMENTAL_BASE_LEVEL)
+        balance();
+}
+
+void IncrementalPhotonMap::scalePower(float factor)
+{
+    for (Photon &p : photons)
+        p.power = p.power * factor;
+}
+
+void IncrementalPhotonMap::balance()
+{
+    if (tailStart == photons.size())
+        return;
+
+    // Absorb every trailing level no larger than what is being built, so the
+    // merged run is always a suffix of the array.
+    size_t start = tailStart;
+    while (!levels.empty() && levels.back().count <= photons.size() - start)
+    {
+        start = levels.back().start;
+        levels.pop_back();
+    }
+
+    std::vector<Photon> merged(photons.begin() + start, photons.end());
+    kdBalance(merged, cancelFlag);
+    std::copy(merged.begin(), merged.end(), photons.begin() + start);
+
+    levels.push_back({start, merged.size()});
+    tailStart = photons.size();
+}
+
+void IncrementalPhotonMap::locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                         PhotonHeap &heap) const
+{
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+    auto push = [&](const Photon &p, float distSq)
+    {
+        heap.push(distSq, &p, maxPhotons, maxDistSq);
+    };
+
+    // Smallest levels first: they are cheap and tighten the radius early.
+    for (size_t i = photons.size(); i-- > tailStart;)
+    {
+        float distSq = (pos - photons[i].position).lengthSq();
+        if (distSq < maxDistSq)
+            push(photons[i], distSq);
+    }
+    for (size_t l = levels.size(); l-- > 0;)
+        kdLocateNearest(photons.data() + levels[l].start, levels[l].count, pos, maxDistSq, push,
+                        farScaleSq);
+}
@@ -0,0 +1,100 @@
+#include "renderer/photon_irradiance.h"
+#include "renderer/photon_map.h"
+#include "renderer/photon_direction.h"
+#include <cmath>
+
+static const float IRRADIANCE_PI = 3.14159265359f;
+
+void IrradiancePhotonMap::build(const PhotonMapBackend &map, const Photon *source, size_t count,
+                                int stride, float initialRadius,
+                                const std::atomic<bool> *cancel)
+{
+    photons.clear();
+    if (count == 0 || stride <= 0)
+        return;
+
+    photons.resize((count + stride - 1) / stride);
+
+#pragma omp parallel for schedule(dynamic, 64)
+    for (long long i = 0; i < (long long)photons.size(); i++)
+    {
+        if (cancel && *cancel)
+            continue;
+        const Photon &p = source[i * stride];
+        Vec3 normal = decodePhotonDirection(p.normalTheta, p.normalPhi);
+
+        PhotonHeap heap;
+        float maxDistSq = initialRadius * initialRadius;
+        map.locatePhotons(p.position, MAX_GATHER_PHOTONS, maxDistSq, heap);
+
+        // Only photons that landed on the same side of the same surface count.
+        Vec3 flux(0, 0, 0);
+        for (int j = 0; j < heap.size(); j++)
+        {
+            const Photon &q = *heap.entries[j].photon;
+            if (normal.dot(q.incomingDir) <= 0)
+                continue;
+            if (normal.dot(decodePhotonDirection(q.normalTheta, q.normalPhi)) < IRRADIANCE_NORMAL_COS)
+                continue;
+            flux += q.power;
+        }
+
+        IrradiancePhoton &e = photons[i];
+        e.position = p.position;
+        e.irradiance = Vec3(0, 0, 0);
+        if (!heap.empty() && heap.maxDistSq() > 0)
+            e.irradiance = flux * (1.0f / (IRRADIANCE_PI * heap.maxDistSq()));
+        e.normalTheta = p.normalTheta;
+        e.normalPhi = p.normalPhi;
+        e.axis = 0;
+    }
+
+    if (cancel && *cancel)
+    {
+        photons.clear();
+        return;
+    }
+    kdBalance(photons, cancel);
+}
+
+// Nearest irradiance photon within sqrt(maxDistSq) facing along `normal`.
+template <typename NodeCounter>
+static const IrradiancePhoton *nearestFacing(const std::vector<IrradiancePhoton> &photons,
+                                             const Vec3 &pos, const Vec3 &normal,
+                                             float &maxDistSq, PhotonQueryStats *stats,
+                                             NodeCounter countNode)
+{
+    const IrradiancePhoton *nearest = nullptr;
+    kdLocateNearest(photons.data(), photons.size(), pos, maxDistSq,
+                    [&](const IrradiancePhoton &p, float distSq)
+                    {
+                        if (normal.dot(decodePhotonDirection(p.normalTheta, p.normalPhi)) <
+                            IRRADIANCE_NORMAL_COS)
+                            return;
+                        nearest = &p;
+                        maxDistSq = distSq;
+                    },
+                    1.0f, stats, countNode);
+    return nearest;
+}
+
+bool IrradiancePhotonMap::lookup(const Vec3 &pos, const Vec3 &normal, float maxDistSq,
+                                 Vec3 &irradiance, PhotonQueryStats *stats) const
+{
+    const IrradiancePhoton *nearest =
+        nearestFacing(photons, pos, normal, maxDistSq, stats, NoNodeCount());
+    PHOTON_STAT(if (stats) { stats->queries++; stats->radiusSum += std::sqrt(maxDistSq); });
+
+    if (!nearest)
+        return false;
+    irradiance = nearest->irradiance;
+    return true;
+}
+
+uint32_t IrradiancePhotonMap::lookupNodes(const Vec3 &pos, const Vec3 &normal,
+                                          float maxDistSq) const
+{
+    uint32_t nodes = 0;
+    nearestFacing(photons, pos, normal, maxDistSq, nullptr, NodeTally{&nodes});
+    return nodes;
+}
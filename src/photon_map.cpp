@@ -1,93 +1,189 @@
 #include "renderer/photon_map.h"
+#include "renderer/photon_direction.h"
 #include <algorithm>
+#include <numeric>
+#include <cmath>
 
-void PhotonMap::store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir)
+// Widens the warm-start radius in locatePhotonsBatch so rounding in the
+// bound never excludes a photon the cold query would have found.
+static const float WARM_START_SLACK = 1.0001f;
+
+// Spreads the low 10 bits of v so they occupy every third bit.
+static uint32_t expandBits(uint32_t v)
 {
-    Photon p;
-    p.position = pos;
-    p.power = power;
-    p.incomingDir = inDir;
-    p.axis = 0;
-    photons.push_back(p);
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
 }
 
-void PhotonMap::balance()
+// Adds one lookup into a heap to `stats` once it goes out of scope: the
+// heap's pushes and pops since construction, and the final radius. Empty
+// unless built with PHOTON_STATS.
+class QueryRecorder
 {
-    if (photons.empty())
-        return;
-    std::vector<Photon> balanced(photons.size());
-    balanceSegment(balanced, 0, 0, photons.size());
-    photons = std::move(balanced);
+public:
+#ifdef PHOTON_STATS
+    QueryRecorder(PhotonQueryStats *stats, const PhotonHeap &heap, const float &maxDistSq)
+        : stats(stats), heap(heap), maxDistSq(maxDistSq), pushes(heap.pushes), pops(heap.pops)
+    {
+    }
+
+    ~QueryRecorder()
+    {
+        stats->queries++;
+        stats->heapPushes += heap.pushes - pushes;
+        stats->heapPops += heap.pops - pops;
+        stats->radiusSum += std::sqrt(maxDistSq);
+    }
+
+private:
+    PhotonQueryStats *stats;
+    const PhotonHeap &heap;
+    const float &maxDistSq;
+    uint32_t pushes, pops;
+#else
+    QueryRecorder(PhotonQueryStats *, const PhotonHeap &, const float &) {}
+#endif
+};
+
+void PhotonMapBackend::locatePhotonsBatch(const Vec3 *positions, int count, int maxPhotons,
+                                          float initialMaxDistSq, PhotonHeap *heaps) const
+{
+    for (int i = 0; i < count; i++)
+    {
+        float maxDistSq = initialMaxDistSq;
+        heaps[i].clear();
+        locatePhotons(positions[i], maxPhotons, maxDistSq, heaps[i]);
+    }
 }
 
-void PhotonMap::balanceSegment(std::vector<Photon> &balanced, size_t index,
-                               size_t start, size_t end)
+void PhotonMapBackend::precomputeIrradiance(int stride, float initialRadius)
 {
-    if (start >= end)
+    if (!photonData())
         return;
+    irradiance.build(*this, photonData(), size(), stride, initialRadius, cancelFlag);
+}
 
-    Vec3 bboxMin(1e30f, 1e30f, 1e30f);
-    Vec3 bboxMax(-1e30f, -1e30f, -1e30f);
+static std::atomic<uint64_t> nextPhotonMapId{0};
 
-    for (size_t i = start; i < end; i++)
-    {
-        bboxMin = Vec3(
-            std::min(bboxMin.x, photons[i].position.x),
-            std::min(bboxMin.y, photons[i].position.y),
-            std::min(bboxMin.z, photons[i].position.z));
-        bboxMax = Vec3(
-            std::max(bboxMax.x, photons[i].position.x),
-            std::max(bboxMax.y, photons[i].position.y),
-            std::max(bboxMax.z, photons[i].position.z));
-    }
+PhotonMap::PhotonMap() : id(nextPhotonMapId++)
+{
+}
 
-    Vec3 extent = bboxMax - bboxMin;
-    int axis = 0;
-    if (extent.y > extent.x && extent.y > extent.z)
-        axis = 1;
-    else if (extent.z > extent.x && extent.z > extent.y)
-        axis = 2;
-
-    size_t mid = (start + end) / 2;
-    std::nth_element(photons.begin() + start, photons.begin() + mid,
-                     photons.begin() + end,
-                     [axis](const Photon &a, const Photon &b)
-                     {
-                         return a.position[axis] < b.position[axis];
-                     });
-
-    balanced[index] = photons[mid];
-    balanced[index].axis = axis;
-
-    size_t leftChild = 2 * index + 1;
-    size_t rightChild = 2 * index + 2;
-
-    if (mid > start && leftChild < balanced.size())
+PhotonMap::StoreBuffer &PhotonMap::threadStoreBuffer()
+{
+    // Map ids are never reused, so entries left behind by destroyed maps are
+    // simply never matched again.
+    thread_local std::vector<std::pair<uint64_t, StoreBuffer *>> buffers;
+    for (const auto &entry : buffers)
     {
-        balanceSegment(balanced, leftChild, start, mid);
+        if (entry.first == id)
+            return *entry.second;
     }
-    if (mid + 1 < end && rightChild < balanced.size())
+
+    std::lock_guard<std::mutex> lock(storeMutex);
+    storeBuffers.push_back(std::make_unique<StoreBuffer>());
+    StoreBuffer *buffer = storeBuffers.back().get();
+    buffer->photons.reserve(PHOTON_STORE_CHUNK);
+    buffers.emplace_back(id, buffer);
+    return *buffer;
+}
+
+void PhotonMap::flushStoreBuffer(StoreBuffer &buffer)
+{
+    size_t n = buffer.photons.size();
+    size_t at = sharedCount.fetch_add(n);
+    // Every claimed slot below shared.size() gets written, so the filled
+    // prefix is always min(sharedCount, shared.size()).
+    size_t fits = at < shared.size() ? std::min(n, shared.size() - at) : 0;
+    std::copy(buffer.photons.begin(), buffer.photons.begin() + fits, shared.begin() + at);
+    if (fits < n)
     {
-        balanceSegment(balanced, rightChild, mid + 1, end);
+        std::lock_guard<std::mutex> lock(storeMutex);
+        overflow.insert(overflow.end(), buffer.photons.begin() + fits, buffer.photons.end());
     }
+    buffer.photons.clear();
+}
+
+void PhotonMap::store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+                      const Vec3 &normal, int /*primitive*/)
+{
+    Photon p;
+    p.position = pos;
+    p.power = power;
+    p.incomingDir = inDir;
+    p.axis = 0;
+    encodePhotonDirection(normal, p.normalTheta, p.normalPhi);
+
+    StoreBuffer &buffer = threadStoreBuffer();
+    buffer.photons.push_back(p);
+    if (buffer.photons.size() >= PHOTON_STORE_CHUNK)
+        flushStoreBuffer(buffer);
+}
+
+void PhotonMap::reserve(size_t count)
+{
+    flushStores();
+    shared.resize(count);
+}
+
+void PhotonMap::flushStores()
+{
+    for (const std::unique_ptr<StoreBuffer> &buffer : storeBuffers)
+        flushStoreBuffer(*buffer);
+
+    size_t filled = std::min(sharedCount.load(), shared.size());
+    photons.insert(photons.end(), shared.begin(), shared.begin() + filled);
+    photons.insert(photons.end(), overflow.begin(), overflow.end());
+    std::vector<Photon>().swap(shared);
+    std::vector<Photon>().swap(overflow);
+    sharedCount = 0;
+}
+
+void PhotonMap::scalePower(float factor)
+{
+    flushStores();
+    for (Photon &p : photons)
+        p.power = p.power * factor;
+}
+
+void PhotonMap::balance()
+{
+    if (mapped)
+        return;
+    flushStores();
+    replicas.clear();
+    veb.clear();
+    kdBalance(photons, cancelFlag);
+    if (cancelled())
+        return;
+    buckets.build(photons);
 }
 
 void PhotonMap::locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
                               std::priority_queue<PhotonDistEntry> &heap) const
 {
-    if (photons.empty())
+    if (nodeCount() == 0)
         return;
-    locatePhotonsImpl(pos, 0, maxPhotons, maxDistSq, heap);
+    PhotonQueryStats *stats = threadStats();
+    locatePhotonsImpl(pos, 0, maxPhotons, maxDistSq, heap, stats);
+    PHOTON_STAT(stats->queries++; stats->radiusSum += std::sqrt(maxDistSq));
 }
 
 void PhotonMap::locatePhotonsImpl(const Vec3 &pos, size_t index, int maxPhotons,
                                   float &maxDistSq,
-                                  std::priority_queue<PhotonDistEntry> &heap) const
+                                  std::priority_queue<PhotonDistEntry> &heap,
+                                  PhotonQueryStats *stats) const
 {
-    if (index >= photons.size())
+    const Photon *nodes = nodeData();
+    size_t count = nodeCount();
+    if (index >= count)
         return;
 
-    const Photon &p = photons[index];
+    const Photon &p = nodes[index];
     int axis = p.axis;
 
     float delta = pos[axis] - p.position[axis];
@@ -95,13 +191,15 @@ void PhotonMap::locatePhotonsImpl(const Vec3 &pos, size_t index, int maxPhotons,
     size_t nearChild = (delta < 0) ? (2 * index + 1) : (2 * index + 2);
     size_t farChild = (delta < 0) ? (2 * index + 2) : (2 * index + 1);
 
-    if (nearChild < photons.size())
+    PHOTON_STAT(stats->nodesVisited++);
+    if (nearChild < count)
     {
-        locatePhotonsImpl(pos, nearChild, maxPhotons, maxDistSq, heap);
+        locatePhotonsImpl(pos, nearChild, maxPhotons, maxDistSq, heap, stats);
     }
 
     Vec3 diff = pos - p.position;
     float distSq = diff.lengthSq();
+    PHOTON_STAT(stats->distanceTests++);
 
     if (distSq < maxDistSq)
     {
@@ -109,16 +207,160 @@ void PhotonMap::locatePhotonsImpl(const Vec3 &pos, size_t index, int maxPhotons,
         entry.distSq = distSq;
         entry.photon = &p;
         heap.push(entry);
+        PHOTON_STAT(stats->heapPushes++);
 
         if ((int)heap.size() > maxPhotons)
         {
             heap.pop();
+            PHOTON_STAT(stats->heapPops++);
             maxDistSq = heap.top().distSq;
         }
     }
 
-    if (delta * delta < maxDistSq && farChild < photons.size())
+    if (delta * delta * farScaleSq < maxDistSq && farChild < count)
+    {
+        PHOTON_STAT(stats->farDescents++);
+        locatePhotonsImpl(pos, farChild, maxPhotons, maxDistSq, heap, stats);
+    }
+}
+
+void PhotonMap::locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                              PhotonHeap &heap) const
+{
+    if (nodeCount() == 0)
+        return;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+    PhotonQueryStats *stats = threadStats();
+    QueryRecorder record(stats, heap, maxDistSq);
+    kdLocateNearest(nodeData(), nodeCount(), pos, maxDistSq,
+                    [&](const Photon &p, float distSq)
+                    {
+                        heap.push(distSq, &p, maxPhotons, maxDistSq);
+                    },
+                    farScaleSq, stats);
+}
+
+uint32_t PhotonMap::lookupNodes(const Vec3 &pos, int maxPhotons, float maxDistSq) const
+{
+    uint32_t nodes = 0;
+    PhotonHeap heap;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+    kdLocateNearest(nodeData(), nodeCount(), pos, maxDistSq,
+                    [&](const Photon &p, float distSq)
+                    {
+                        heap.push(distSq, &p, maxPhotons, maxDistSq);
+                    },
+                    farScaleSq, nullptr, NodeTally{&nodes});
+    return nodes;
+}
+
+uint32_t PhotonMap::rangeLookupNodes(const Vec3 &pos, float radiusSq) const
+{
+    uint32_t nodes = 0;
+    kdLocateRange(nodeData(), nodeCount(), pos, radiusSq, [](const Photon &, float) {}, nullptr,
+                  NodeTally{&nodes});
+    return nodes;
+}
+
+void PhotonMap::locatePhotonsBucketed(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                      PhotonHeap &heap) const
+{
+    // Mapped maps carry no bucket tree.
+    if (buckets.empty())
+    {
+        locatePhotons(pos, maxPhotons, maxDistSq, heap);
+        return;
+    }
+    PhotonQueryStats *stats = threadStats();
+    QueryRecorder record(stats, heap, maxDistSq);
+    buckets.locatePhotons(nodeData(), pos, maxPhotons, maxDistSq, heap, farScaleSq, stats);
+}
+
+void PhotonMap::buildVebLayout()
+{
+    veb.build(storageData(), nodeCount(), cancelFlag);
+}
+
+void PhotonMap::locatePhotonsVeb(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                 PhotonHeap &heap) const
+{
+    if (veb.empty())
+    {
+        locatePhotons(pos, maxPhotons, maxDistSq, heap);
+        return;
+    }
+    PhotonQueryStats *stats = threadStats();
+    QueryRecorder record(stats, heap, maxDistSq);
+    veb.locatePhotons(nodeData(), pos, maxPhotons, maxDistSq, heap, farScaleSq, stats);
+}
+
+void PhotonMap::locatePhotonsBatch(const Vec3 *positions, int count, int maxPhotons,
+                                   float initialMaxDistSq, PhotonHeap *heaps) const
+{
+    for (int i = 0; i < count; i++)
+        heaps[i].clear();
+    if (nodeCount() == 0 || count <= 0)
+        return;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+
+    Vec3 bboxMin(1e30f, 1e30f, 1e30f);
+    Vec3 bboxMax(-1e30f, -1e30f, -1e30f);
+    for (int i = 0; i < count; i++)
+    {
+        const Vec3 &p = positions[i];
+        bboxMin = Vec3(std::min(bboxMin.x, p.x), std::min(bboxMin.y, p.y), std::min(bboxMin.z, p.z));
+        bboxMax = Vec3(std::max(bboxMax.x, p.x), std::max(bboxMax.y, p.y), std::max(bboxMax.z, p.z));
+    }
+    Vec3 extent = bboxMax - bboxMin;
+    float scale = 1023.0f / std::max(1e-6f, std::max(extent.x, std::max(extent.y, extent.z)));
+
+    std::vector<uint32_t> codes(count);
+    for (int i = 0; i < count; i++)
     {
-        locatePhotonsImpl(pos, farChild, maxPhotons, maxDistSq, heap);
+        Vec3 q = (positions[i] - bboxMin) * scale;
+        codes[i] = (expandBits((uint32_t)q.x) << 2) | (expandBits((uint32_t)q.y) << 1) |
+                   expandBits((uint32_t)q.z);
+    }
+    std::vector<int> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&codes](int a, int b)
+              { return codes[a] < codes[b]; });
+
+    // Neighbouring queries in curve order share most of their tree path. The
+    // previous query's k photons also lie within its radius plus the distance
+    // between the two, which bounds this query's radius from the start.
+    const Vec3 *prevPos = nullptr;
+    float prevRadius = 0.0f;
+    PhotonQueryStats *stats = threadStats();
+    for (int i = 0; i < count; i++)
+    {
+        const Vec3 &pos = positions[order[i]];
+        PhotonHeap &heap = heaps[order[i]];
+        float maxDistSq = initialMaxDistSq;
+        if (prevPos)
+        {
+            float bound = (prevRadius + (pos - *prevPos).length()) * WARM_START_SLACK;
+            maxDistSq = std::min(maxDistSq, bound * bound);
+        }
+
+        {
+            QueryRecorder record(stats, heap, maxDistSq);
+            kdLocateNearest(nodeData(), nodeCount(), pos, maxDistSq,
+                            [&](const Photon &p, float distSq)
+                            {
+                                heap.push(distSq, &p, maxPhotons, maxDistSq);
+                            },
+                            farScaleSq, stats);
+        }
+
+        if (heap.size() == maxPhotons)
+        {
+            prevPos = &pos;
+            prevRadius = std::sqrt(heap.maxDistSq());
+        }
+        else
+        {
+            prevPos = nullptr;
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,169 @@
+#include "renderer/photon_map.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#include <fstream>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Photon records start on their own cache line.
+static const uint64_t PHOTON_MAP_DATA_OFFSET = 64;
+
+PhotonMap::~PhotonMap()
+{
+    unmap();
+}
+
+bool PhotonMap::save(const std::string &path) const
+{
+    PhotonMapFileHeader header = {};
+    std::memcpy(header.magic, PHOTON_MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = PHOTON_MAP_FILE_VERSION;
+    header.byteOrder = PHOTON_MAP_FILE_BYTE_ORDER;
+    header.photonSize = sizeof(Photon);
+    header.count = nodeCount();
+    header.dataOffset = PHOTON_MAP_DATA_OFFSET;
+
+    std::string tmpPath = path + ".tmp." + std::to_string(getpid());
+    FILE *file = std::fopen(tmpPath.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Failed to write photon map: " << tmpPath << std::endl;
+        return false;
+    }
+
+    char padding[PHOTON_MAP_DATA_OFFSET] = {};
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+              std::fwrite(padding, PHOTON_MAP_DATA_OFFSET - sizeof(header), 1, file) == 1;
+    if (ok && header.count > 0)
+        ok = std::fwrite(nodeData(), sizeof(Photon), header.count, file) == header.count;
+    ok = std::fclose(file) == 0 && ok;
+
+    if (ok)
+    {
+        std::remove(path.c_str());
+        ok = std::rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+    if (!ok)
+    {
+        std::cerr << "Failed to write photon map: " << path << std::endl;
+        std::remove(tmpPath.c_str());
+    }
+    return ok;
+}
+
+static bool validHeader(const PhotonMapFileHeader &header, uint64_t fileSize)
+{
+    return std::memcmp(header.magic, PHOTON_MAP_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+           header.version == PHOTON_MAP_FILE_VERSION &&
+           header.byteOrder == PHOTON_MAP_FILE_BYTE_ORDER &&
+           header.photonSize == sizeof(Photon) &&
+           header.dataOffset >= sizeof(header) &&
+           header.dataOffset % alignof(Photon) == 0 &&
+           header.dataOffset <= fileSize &&
+           header.count == (fileSize - header.dataOffset) / sizeof(Photon) &&
+           (fileSize - header.dataOffset) % sizeof(Photon) == 0;
+}
+
+#ifdef _WIN32
+
+// No shared mapping here; read the records into the vector instead.
+bool PhotonMap::loadMapped(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file)
+        return false;
+    uint64_t fileSize = (uint64_t)file.tellg();
+    file.seekg(0);
+
+    PhotonMapFileHeader header;
+    if (fileSize < sizeof(header) || !file.read((char *)&header, sizeof(header)) ||
+        !validHeader(header, fileSize))
+    {
+        std::cerr << "Invalid photon map file: " << path << std::endl;
+        return false;
+    }
+
+    std::vector<Photon> loaded(header.count);
+    file.seekg(header.dataOffset);
+    if (!file.read((char *)loaded.data(), header.count * sizeof(Photon)))
+        return false;
+
+    replicas.clear();
+    veb.clear();
+    unmap();
+    photons = std::move(loaded);
+    buckets.build(photons);
+    return true;
+}
+
+void PhotonMap::unmap()
+{
+}
+
+#else
+
+bool PhotonMap::loadMapped(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(PhotonMapFileHeader))
+    {
+        close(fd);
+        std::cerr << "Invalid photon map file: " << path << std::endl;
+        return false;
+    }
+
+    size_t fileSize = (size_t)st.st_size;
+    void *data = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "Failed to map photon map: " << path << std::endl;
+        return false;
+    }
+
+    const PhotonMapFileHeader &header = *static_cast<const PhotonMapFileHeader *>(data);
+    if (!validHeader(header, fileSize))
+    {
+        munmap(data, fileSize);
+        std::cerr << "Invalid photon map file: " << path << std::endl;
+        return false;
+    }
+
+    replicas.clear();
+    veb.clear();
+    unmap();
+    photons.clear();
+    photons.shrink_to_fit();
+    buckets.clear();
+
+    mapping = data;
+    mappingSize = fileSize;
+    mapped = reinterpret_cast<const Photon *>(static_cast<const char *>(data) + header.dataOffset);
+    mappedCount = header.count;
+    return true;
+}
+
+void PhotonMap::unmap()
+{
+    if (mapping)
+        munmap(mapping, mappingSize);
+    mapping = nullptr;
+    mappingSize = 0;
+    mapped = nullptr;
+    mappedCount = 0;
+}
+
+#endif
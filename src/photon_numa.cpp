@@ -0,0 +1,278 @@
+#include "renderer/photon_numa.h"
+#include "renderer/photon_map.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+bool parseHugePageMode(const std::string &name, HugePageMode &mode)
+{
+    if (name == "off")
+    {
+        mode = HugePageMode::Off;
+        return true;
+    }
+    if (name == "thp")
+    {
+        mode = HugePageMode::Transparent;
+        return true;
+    }
+    if (name == "explicit")
+    {
+        mode = HugePageMode::Explicit;
+        return true;
+    }
+    return false;
+}
+
+PhotonReplicas::~PhotonReplicas()
+{
+    clear();
+}
+
+#ifdef __linux__
+
+namespace
+{
+const size_t DEFAULT_HUGE_PAGE_SIZE = size_t(2) << 20;
+
+struct NumaNode
+{
+    int id;
+    std::vector<int> cpus;
+};
+
+std::string readFirstLine(const std::string &path)
+{
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+// Parses sysfs lists such as "0-3,8,10-11".
+std::vector<int> parseList(const std::string &list)
+{
+    std::vector<int> values;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ','))
+    {
+        int first, last;
+        char dash;
+        std::stringstream rs(range);
+        if (!(rs >> first))
+            continue;
+        last = (rs >> dash >> last) ? last : first;
+        for (int v = first; v <= last; v++)
+            values.push_back(v);
+    }
+    return values;
+}
+
+std::vector<NumaNode> numaNodes()
+{
+    std::vector<NumaNode> nodes;
+    for (int id : parseList(readFirstLine("/sys/devices/system/node/online")))
+    {
+        std::vector<int> cpus =
+            parseList(readFirstLine("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"));
+        // Memory-only nodes have no CPUs to read from them.
+        if (!cpus.empty())
+            nodes.push_back({id, cpus});
+    }
+    return nodes;
+}
+
+size_t hugePageSize()
+{
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    size_t kb;
+    while (meminfo >> key)
+    {
+        if (key == "Hugepagesize:" && meminfo >> kb)
+            return kb << 10;
+        meminfo.ignore(256, '\n');
+    }
+    return DEFAULT_HUGE_PAGE_SIZE;
+}
+
+size_t roundUp(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+// AnonHugePages of the mappings overlapping [data, data + length), which an
+// accepted MADV_HUGEPAGE does not guarantee.
+size_t transparentHugeBytes(const void *data, size_t length)
+{
+    std::ifstream smaps("/proc/self/smaps");
+    unsigned long long begin = (uintptr_t)data, end = begin + length;
+    bool overlaps = false;
+    size_t total = 0;
+    std::string line;
+    while (std::getline(smaps, line))
+    {
+        unsigned long long lo, hi;
+        size_t kb;
+        if (std::sscanf(line.c_str(), "%llx-%llx", &lo, &hi) == 2)
+            overlaps = lo < end && hi > begin;
+        else if (overlaps && std::sscanf(line.c_str(), "AnonHugePages: %zu kB", &kb) == 1)
+            total += kb << 10;
+    }
+    return std::min(total, length);
+}
+}
+
+// Maps and fills one copy from the calling thread, so first touch places its
+// pages on that thread's node.
+static bool allocateReplica(const Photon *photons, size_t count, HugePageMode hugePages,
+                            void *&data, size_t &length, size_t &hugeBytes, bool &thpAdvised)
+{
+    size_t bytes = count * sizeof(Photon);
+    size_t pageSize = hugePageSize();
+    data = MAP_FAILED;
+    hugeBytes = 0;
+    thpAdvised = false;
+
+    if (hugePages == HugePageMode::Explicit)
+    {
+        length = roundUp(bytes, pageSize);
+        data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                    -1, 0);
+        if (data != MAP_FAILED)
+            hugeBytes = length;
+    }
+    if (data == MAP_FAILED && hugePages != HugePageMode::Off)
+    {
+        // Transparent huge pages need huge-page aligned ranges; map extra and
+        // trim both ends to the alignment.
+        length = roundUp(bytes, pageSize);
+        void *raw = mmap(nullptr, length + pageSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return false;
+        char *aligned = (char *)roundUp((size_t)raw, pageSize);
+        size_t head = aligned - (char *)raw;
+        if (head > 0)
+            munmap(raw, head);
+        munmap(aligned + length, pageSize - head);
+        data = aligned;
+        thpAdvised = madvise(data, length, MADV_HUGEPAGE) == 0;
+    }
+    if (data == MAP_FAILED)
+    {
+        length = bytes;
+        data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            return false;
+    }
+
+    std::memcpy(data, photons, bytes);
+    mprotect(data, length, PROT_READ);
+    if (thpAdvised)
+        hugeBytes = transparentHugeBytes(data, length);
+    return true;
+}
+
+void PhotonReplicas::build(const Photon *photons, size_t count, bool perNode, HugePageMode hugePages)
+{
+    clear();
+    if (count == 0)
+        return;
+
+    std::vector<NumaNode> nodes;
+    if (perNode)
+        nodes = numaNodes();
+    // A single unpinned copy when replication is off or the topology is unknown.
+    if (nodes.empty())
+        nodes.push_back({0, {}});
+
+    for (const NumaNode &node : nodes)
+    {
+        void *data = nullptr;
+        size_t length = 0;
+        size_t hugeBytes = 0;
+        bool thpAdvised = false;
+        bool ok = false;
+        std::thread worker([&]
+                           {
+                               if (!node.cpus.empty())
+                               {
+                                   cpu_set_t set;
+                                   CPU_ZERO(&set);
+                                   for (int cpu : node.cpus)
+                                   {
+                                       if (cpu < CPU_SETSIZE)
+                                           CPU_SET(cpu, &set);
+                                   }
+                                   sched_setaffinity(0, sizeof(set), &set);
+                               }
+                               ok = allocateReplica(photons, count, hugePages, data, length, hugeBytes,
+                                                    thpAdvised);
+                           });
+        worker.join();
+        if (!ok)
+            continue;
+
+        int index = (int)replicas.size();
+        replicas.push_back({node.id, static_cast<Photon *>(data), length, hugeBytes, thpAdvised});
+        for (int cpu : node.cpus)
+        {
+            if (cpu >= (int)replicaOfCpu.size())
+                replicaOfCpu.resize(cpu + 1, -1);
+            replicaOfCpu[cpu] = index;
+        }
+    }
+}
+
+void PhotonReplicas::clear()
+{
+    for (const Replica &r : replicas)
+        munmap(r.data, r.bytes);
+    replicas.clear();
+    replicaOfCpu.clear();
+}
+
+const Photon *PhotonReplicas::local() const
+{
+    if (replicas.empty())
+        return nullptr;
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < (int)replicaOfCpu.size() && replicaOfCpu[cpu] >= 0)
+        return replicas[replicaOfCpu[cpu]].data;
+    return replicas[0].data;
+}
+
+#else
+
+void PhotonReplicas::build(const Photon *, size_t, bool, HugePageMode)
+{
+}
+
+void PhotonReplicas::clear()
+{
+}
+
+const Photon *PhotonReplicas::local() const
+{
+    return nullptr;
+}
+
+#endif
+
+std::vector<PhotonReplicaUsage> PhotonReplicas::usage() const
+{
+    std::vector<PhotonReplicaUsage> result;
+    for (const Replica &r : replicas)
+        result.push_back({r.node, r.bytes, r.hugeBytes, r.thpAdvised});
+    return result;
+}
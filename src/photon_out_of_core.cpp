@@ -0,0 +1,466 @@
+#include "renderer/photon_out_of_core.h"
+#include "renderer/photon_direction.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// Per-page write buffers used while sorting photons into pages never get
+// smaller than this, whatever the cache budget.
+static const size_t MIN_PAGE_WRITE_BUFFER = 64;
+
+static std::atomic<uint64_t> nextMapId{0};
+
+// Calls visit(photons, count) for every chunk of a spill file, in order.
+template <typename Visitor>
+static bool readSpill(const std::string &path, Visitor &&visit)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::vector<Photon> chunk(OUT_OF_CORE_SPILL_CHUNK);
+    while (file)
+    {
+        file.read((char *)chunk.data(), chunk.size() * sizeof(Photon));
+        size_t n = (size_t)file.gcount() / sizeof(Photon);
+        if (n > 0)
+            visit(chunk.data(), n);
+    }
+    return file.eof();
+}
+
+PhotonPageCache::PhotonPageCache(const std::string &path, const std::vector<Page> &pages,
+                                 size_t capacityPhotons)
+    : file(path, std::ios::binary), pages(pages), entries(pages.size()), capacity(capacityPhotons)
+{
+}
+
+// Evicts unpinned pages until `incoming` more photons fit. Caller holds the lock.
+void PhotonPageCache::evict(size_t incoming)
+{
+    while (residentPhotons + incoming > capacity && !lru.empty())
+    {
+        Entry &victim = entries[lru.back()];
+        lru.pop_back();
+        residentPhotons -= victim.photons.size();
+        residentPages--;
+        std::vector<Photon>().swap(victim.photons);
+        victim.resident = false;
+        evictions++;
+    }
+}
+
+const Photon *PhotonPageCache::pin(uint32_t page)
+{
+    // Misses read under the lock; lookups are coherent enough that they are
+    // rare once the working set is resident.
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &e = entries[page];
+    if (e.resident)
+    {
+        hits++;
+        if (e.pins++ == 0)
+            lru.erase(e.lruPosition);
+        return e.photons.data();
+    }
+
+    misses++;
+    const Page &p = pages[page];
+    evict(p.count);
+    e.photons.assign(p.count, Photon());
+    file.seekg((std::streamoff)(p.offset * sizeof(Photon)));
+    if (!file.read((char *)e.photons.data(), p.count * sizeof(Photon)))
+    {
+        std::cerr << "Failed to read photon page " << page << std::endl;
+        file.clear();
+        std::fill(e.photons.begin(), e.photons.end(), Photon());
+    }
+    e.resident = true;
+    e.pins = 1;
+    residentPhotons += p.count;
+    residentPages++;
+    return e.photons.data();
+}
+
+void PhotonPageCache::unpin(uint32_t page)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &e = entries[page];
+    if (--e.pins > 0)
+        return;
+    lru.push_front(page);
+    e.lruPosition = lru.begin();
+    evict(0);
+}
+
+PhotonPageCacheStats PhotonPageCache::stats() const
+{
+    PhotonPageCacheStats s;
+    s.hits = hits;
+    s.misses = misses;
+    s.evictions = evictions;
+    std::lock_guard<std::mutex> lock(mutex);
+    s.residentPages = residentPages;
+    s.residentPhotons = residentPhotons;
+    return s;
+}
+
+void PhotonPageCache::resetStats()
+{
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+}
+
+// Pages pinned by one thread's lookups on one map. The previous lookup's pins
+// are held until the current one ends, so a page both use is handed over
+// without going through the cache.
+class OutOfCorePhotonMap::Pins
+{
+public:
+    explicit Pins(uint64_t map) : map(map) {}
+
+    uint64_t map;
+
+    void begin() { held.swap(previous); }
+
+    const Photon *pin(PhotonPageCache &cache, uint32_t page)
+    {
+        for (const Pin &p : held)
+        {
+            if (p.page == page)
+                return p.photons;
+        }
+        for (size_t i = 0; i < previous.size(); i++)
+        {
+            if (previous[i].page == page)
+            {
+                held.push_back(previous[i]);
+                previous[i] = previous.back();
+                previous.pop_back();
+                return held.back().photons;
+            }
+        }
+        held.push_back({page, cache.pin(page)});
+        return held.back().photons;
+    }
+
+    void end(PhotonPageCache &cache)
+    {
+        for (const Pin &p : previous)
+            cache.unpin(p.page);
+        previous.clear();
+    }
+
+private:
+    struct Pin
+    {
+        uint32_t page;
+        const Photon *photons;
+    };
+    std::vector<Pin> held;
+    std::vector<Pin> previous;
+};
+
+OutOfCorePhotonMap::Pins &OutOfCorePhotonMap::threadPins() const
+{
+    // Map ids are never reused, so entries left behind by destroyed maps are
+    // simply never matched again.
+    thread_local std::vector<Pins> table;
+    for (Pins &pins : table)
+    {
+        if (pins.map == id)
+            return pins;
+    }
+    table.emplace_back(id);
+    return table.back();
+}
+
+OutOfCorePhotonMap::OutOfCorePhotonMap(const std::string &directory, size_t cacheBytes,
+                                       size_t pagePhotons)
+    : cacheBytes(cacheBytes), pagePhotons(std::max<size_t>(1, pagePhotons)), id(nextMapId++)
+{
+    std::string base = directory + "/photons-" + std::to_string(getpid()) + "-" + std::to_string(id);
+    spillPath = base + ".spill";
+    pagePath = base + ".pages";
+}
+
+OutOfCorePhotonMap::~OutOfCorePhotonMap()
+{
+    spill.close();
+    cache.reset();
+    std::remove(spillPath.c_str());
+    std::remove(pagePath.c_str());
+}
+
+void OutOfCorePhotonMap::store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+                               const Vec3 &normal, int /*primitive*/)
+{
+    if (built)
+        return;
+
+    Photon p;
+    p.position = pos;
+    p.power = power;
+    p.incomingDir = inDir;
+    p.axis = 0;
+    encodePhotonDirection(normal, p.normalTheta, p.normalPhi);
+    staging.push_back(p);
+    photonCount++;
+
+    if (staging.size() >= OUT_OF_CORE_SPILL_CHUNK)
+        flushStaging();
+}
+
+void OutOfCorePhotonMap::scalePower(float factor)
+{
+    if (!built)
+        powerScale *= factor;
+}
+
+void OutOfCorePhotonMap::flushStaging()
+{
+    if (staging.empty())
+        return;
+    if (!spill.is_open())
+        spill.open(spillPath, std::ios::binary | std::ios::trunc);
+    if (!spill.write((const char *)staging.data(), staging.size() * sizeof(Photon)))
+        std::cerr << "Failed to write photon spill file: " << spillPath << std::endl;
+    staging.clear();
+}
+
+uint32_t OutOfCorePhotonMap::buildTop(std::vector<Vec3> &sample, size_t begin, size_t end,
+                                      size_t leafSample)
+{
+    uint32_t node = (uint32_t)top.size();
+    top.push_back(TopNode());
+    if (end - begin <= leafSample)
+    {
+        top[node] = {0.0f, -1, 0, (uint32_t)pages.size()};
+        pages.push_back({0, 0});
+        return node;
+    }
+
+    Vec3 bboxMin = sample[begin], bboxMax = sample[begin];
+    for (size_t i = begin + 1; i < end; i++)
+    {
+        const Vec3 &p = sample[i];
+        bboxMin = Vec3(std::min(bboxMin.x, p.x), std::min(bboxMin.y, p.y), std::min(bboxMin.z, p.z));
+        bboxMax = Vec3(std::max(bboxMax.x, p.x), std::max(bboxMax.y, p.y), std::max(bboxMax.z, p.z));
+    }
+    Vec3 extent = bboxMax - bboxMin;
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+    size_t mid = begin + (end - begin) / 2;
+    std::nth_element(sample.begin() + begin, sample.begin() + mid, sample.begin() + end,
+                     [axis](const Vec3 &a, const Vec3 &b)
+                     { return a[axis] < b[axis]; });
+    float split = sample[mid][axis];
+
+    buildTop(sample, begin, mid, leafSample);
+    uint32_t right = buildTop(sample, mid, end, leafSample);
+    top[node] = {split, axis, right, 0};
+    return node;
+}
+
+uint32_t OutOfCorePhotonMap::pageOf(const Vec3 &pos) const
+{
+    uint32_t node = 0;
+    while (top[node].axis >= 0)
+        node = (pos[top[node].axis] < top[node].split) ? node + 1 : top[node].right;
+    return top[node].page;
+}
+
+void OutOfCorePhotonMap::balance()
+{
+    if (built)
+        return;
+    built = true;
+    flushStaging();
+    std::vector<Photon>().swap(staging);
+    spill.close();
+    if (photonCount == 0)
+        return;
+
+    // Page boundaries come from a strided sample of the positions.
+    size_t stride = std::max<size_t>(1, photonCount / OUT_OF_CORE_SAMPLE_SIZE);
+    std::vector<Vec3> sample;
+    size_t index = 0;
+    readSpill(spillPath, [&](const Photon *chunk, size_t n)
+              {
+                  for (size_t i = 0; i < n; i++, index++)
+                  {
+                      if (index % stride == 0)
+                          sample.push_back(chunk[i].position);
+                  }
+              });
+    size_t leafSample = std::max<size_t>(1, pagePhotons * sample.size() / photonCount);
+    buildTop(sample, 0, sample.size(), leafSample);
+    std::vector<Vec3>().swap(sample);
+
+    std::vector<uint64_t> counts(pages.size(), 0);
+    readSpill(spillPath, [&](const Photon *chunk, size_t n)
+              {
+                  for (size_t i = 0; i < n; i++)
+                      counts[pageOf(chunk[i].position)]++;
+              });
+    uint64_t offset = 0;
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+        pages[i].offset = offset;
+        pages[i].count = (uint32_t)counts[i];
+        offset += counts[i];
+    }
+
+    // Scatter the photons into their pages through per-page write buffers
+    // that together take about the cache budget.
+    std::fstream out(pagePath, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    size_t bufferPhotons = std::min(pagePhotons, std::max(MIN_PAGE_WRITE_BUFFER,
+                                                          cacheBytes / sizeof(Photon) / pages.size()));
+    std::vector<std::vector<Photon>> buffers(pages.size());
+    std::vector<uint64_t> written(pages.size(), 0);
+    auto flush = [&](uint32_t page)
+    {
+        std::vector<Photon> &buffer = buffers[page];
+        out.seekp((std::streamoff)((pages[page].offset + written[page]) * sizeof(Photon)));
+        out.write((const char *)buffer.data(), buffer.size() * sizeof(Photon));
+        written[page] += buffer.size();
+        buffer.clear();
+    };
+    readSpill(spillPath, [&](const Photon *chunk, size_t n)
+              {
+                  for (size_t i = 0; i < n; i++)
+                  {
+                      uint32_t page = pageOf(chunk[i].position);
+                      buffers[page].push_back(chunk[i]);
+                      if (buffers[page].size() >= bufferPhotons)
+                          flush(page);
+                  }
+              });
+    for (uint32_t page = 0; page < pages.size(); page++)
+        flush(page);
+    std::vector<std::vector<Photon>>().swap(buffers);
+    std::remove(spillPath.c_str());
+
+    // Each page becomes a left-balanced kd-tree of its own.
+    std::vector<Photon> photons;
+    for (const PhotonPageCache::Page &page : pages)
+    {
+        if (cancelled())
+            break;
+        photons.resize(page.count);
+        out.seekg((std::streamoff)(page.offset * sizeof(Photon)));
+        out.read((char *)photons.data(), page.count * sizeof(Photon));
+        if (powerScale != 1.0f)
+        {
+            for (Photon &p : photons)
+                p.power = p.power * powerScale;
+        }
+        kdBalance(photons);
+        out.seekp((std::streamoff)(page.offset * sizeof(Photon)));
+        out.write((const char *)photons.data(), page.count * sizeof(Photon));
+    }
+    if (!out)
+        std::cerr << "Failed to write photon page file: " << pagePath << std::endl;
+    out.close();
+
+    cache = std::make_unique<PhotonPageCache>(pagePath, pages,
+                                              std::max<size_t>(1, cacheBytes / sizeof(Photon)));
+}
+
+void OutOfCorePhotonMap::locate(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                PhotonHeap &heap, Pins &pins) const
+{
+    auto push = [&](const Photon &p, float distSq)
+    {
+        heap.push(distSq, &p, maxPhotons, maxDistSq);
+    };
+
+    struct StackEntry
+    {
+        uint32_t node;
+        float planeDistSq;
+    };
+    StackEntry stack[PHOTON_STACK_DEPTH];
+    int stackSize = 0;
+    uint32_t node = 0;
+
+    while (true)
+    {
+        while (top[node].axis >= 0)
+        {
+            const TopNode &n = top[node];
+            float delta = pos[n.axis] - n.split;
+            stack[stackSize].node = (delta < 0) ? n.right : node + 1;
+            stack[stackSize].planeDistSq = delta * delta * farScaleSq;
+            stackSize++;
+            node = (delta < 0) ? node + 1 : n.right;
+        }
+
+        uint32_t page = top[node].page;
+        if (pages[page].count > 0)
+            kdLocateNearest(pins.pin(*cache, page), pages[page].count, pos, maxDistSq, push,
+                            farScaleSq);
+
+        bool resumed = false;
+        while (stackSize > 0)
+        {
+            const StackEntry &e = stack[--stackSize];
+            if (e.planeDistSq < maxDistSq)
+            {
+                node = e.node;
+                resumed = true;
+                break;
+            }
+        }
+        if (!resumed)
+            break;
+    }
+}
+
+void OutOfCorePhotonMap::locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                       PhotonHeap &heap) const
+{
+    if (!cache)
+        return;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+    Pins &pins = threadPins();
+    pins.begin();
+    locate(pos, maxPhotons, maxDistSq, heap, pins);
+    pins.end(*cache);
+}
+
+void OutOfCorePhotonMap::locatePhotonsBatch(const Vec3 *positions, int count, int maxPhotons,
+                                            float initialMaxDistSq, PhotonHeap *heaps) const
+{
+    for (int i = 0; i < count; i++)
+        heaps[i].clear();
+    if (!cache || count <= 0)
+        return;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+
+    // One pin set for the whole batch keeps every heap's photons resident.
+    Pins &pins = threadPins();
+    pins.begin();
+    for (int i = 0; i < count; i++)
+    {
+        float maxDistSq = initialMaxDistSq;
+        locate(positions[i], maxPhotons, maxDistSq, heaps[i], pins);
+    }
+    pins.end(*cache);
+}
+
+PhotonPageCacheStats OutOfCorePhotonMap::cacheStats() const
+{
+    return cache ? cache->stats() : PhotonPageCacheStats();
+}
+
+void OutOfCorePhotonMap::resetCacheStats()
+{
+    if (cache)
+        cache->resetStats();
+}
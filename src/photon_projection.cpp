@@ -0,0 +1,122 @@
+#include "renderer/photon_projection.h"
+#include "renderer/scene.h"
+#include <algorithm>
+#include <cmath>
+
+// Direction at grid coordinates (u, v) in [0, PROJECTION_MAP_RESOLUTION]^2,
+// mapped as cosineWeightedHemisphere maps (r1, r2) about the light's -y normal.
+static Vec3 cellDirection(float u, float v)
+{
+    float phi = 2.0f * PI * u / PROJECTION_MAP_RESOLUTION;
+    float sinSq = std::min(v / PROJECTION_MAP_RESOLUTION, 1.0f);
+    float s = std::sqrt(sinSq);
+    return Vec3(std::cos(phi) * s, -std::sqrt(1.0f - sinSq), std::sin(phi) * s);
+}
+
+static float angleBetween(const Vec3 &a, const Vec3 &b)
+{
+    return std::acos(std::min(1.0f, std::max(-1.0f, a.dot(b))));
+}
+
+PhotonProjectionMap::PhotonProjectionMap(const Vec3 &lightCenter, float halfWidth, float halfDepth)
+    : patchWidth(2.0f * halfWidth / PROJECTION_MAP_PATCHES),
+      patchDepth(2.0f * halfDepth / PROJECTION_MAP_PATCHES)
+{
+    // Anything a point of the patch sees within radius r, the patch center
+    // sees within r plus the patch's half diagonal.
+    float patchRadius = 0.5f * std::sqrt(patchWidth * patchWidth + patchDepth * patchDepth);
+    const int res = PROJECTION_MAP_RESOLUTION;
+
+    // Each cell's middle direction and the widest angle from it to the
+    // cell's corners and edge midpoints, padded for the curvature in between.
+    std::vector<Vec3> mids(res * res);
+    std::vector<float> cosSpread(res * res), sinSpread(res * res);
+    for (int cy = 0; cy < res; cy++)
+    {
+        for (int cx = 0; cx < res; cx++)
+        {
+            Vec3 mid = cellDirection(cx + 0.5f, cy + 0.5f);
+            float spread = 0.0f;
+            for (int a = 0; a <= 2; a++)
+            {
+                for (int b = 0; b <= 2; b++)
+                    spread = std::max(spread, angleBetween(mid, cellDirection(cx + 0.5f * a, cy + 0.5f * b)));
+            }
+            spread = std::min(spread * 1.05f, PI);
+            mids[cy * res + cx] = mid;
+            cosSpread[cy * res + cx] = std::cos(spread);
+            sinSpread[cy * res + cx] = std::sin(spread);
+        }
+    }
+
+    for (int pz = 0; pz < PROJECTION_MAP_PATCHES; pz++)
+    {
+        for (int px = 0; px < PROJECTION_MAP_PATCHES; px++)
+        {
+            Patch patch;
+            patch.center = lightCenter + Vec3(-halfWidth + (px + 0.5f) * patchWidth, 0.0f,
+                                              -halfDepth + (pz + 0.5f) * patchDepth);
+
+            Vec3 toSphere[SCENE_SPHERE_COUNT];
+            float cosReach[SCENE_SPHERE_COUNT], sinReach[SCENE_SPHERE_COUNT];
+            for (int i = 0; i < SCENE_SPHERE_COUNT; i++)
+            {
+                const SceneSphere &sphere = sceneSphere(i);
+                Vec3 offset = sphere.center - patch.center;
+                float dist = offset.length();
+                toSphere[i] = offset * (1.0f / dist);
+                float reach = std::asin(std::min(1.0f, (sphere.radius + patchRadius) / dist));
+                cosReach[i] = std::cos(reach);
+                sinReach[i] = std::sin(reach);
+            }
+
+            for (int cell = 0; cell < res * res; cell++)
+            {
+                for (int i = 0; i < SCENE_SPHERE_COUNT; i++)
+                {
+                    // angle(mid, sphere) <= reach + spread, compared as cosines;
+                    // a sum past pi accepts every direction.
+                    float cosLimit = cosReach[i] * cosSpread[cell] - sinReach[i] * sinSpread[cell];
+                    bool pastPi = sinReach[i] * cosSpread[cell] + cosReach[i] * sinSpread[cell] < 0.0f;
+                    if (pastPi || mids[cell].dot(toSphere[i]) >= cosLimit)
+                    {
+                        patch.markedCells.push_back(cell);
+                        break;
+                    }
+                }
+            }
+            patches.push_back(patch);
+        }
+    }
+}
+
+bool PhotonProjectionMap::sample(int index, PhotonSampler &sampler, Vec3 &origin, Vec3 &direction,
+                                 float &weight) const
+{
+    const Patch &patch = patches[index % patches.size()];
+    if (patch.markedCells.empty())
+        return false;
+    sampler.usePointSet(index % patches.size(), index / patches.size());
+
+    float originU = sampler.get(0);
+    float originV = sampler.get(1);
+    origin = patch.center + Vec3((originU - 0.5f) * patchWidth, 0.0f, (originV - 0.5f) * patchDepth);
+
+    size_t pick = std::min(patch.markedCells.size() - 1,
+                           (size_t)(sampler.get(2) * patch.markedCells.size()));
+    int cell = patch.markedCells[pick];
+    float u = cell % PROJECTION_MAP_RESOLUTION + sampler.get(3);
+    float v = cell / PROJECTION_MAP_RESOLUTION + sampler.get(4);
+    direction = cellDirection(u, v);
+
+    weight = (float)patch.markedCells.size() / (PROJECTION_MAP_RESOLUTION * PROJECTION_MAP_RESOLUTION);
+    return true;
+}
+
+float PhotonProjectionMap::coverage() const
+{
+    size_t marked = 0;
+    for (const Patch &patch : patches)
+        marked += patch.markedCells.size();
+    return (float)marked / (patches.size() * PROJECTION_MAP_RESOLUTION * PROJECTION_MAP_RESOLUTION);
+}
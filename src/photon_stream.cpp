@@ -0,0 +1,500 @@
+#include "renderer/photon_stream.h"
+#include "renderer/renderer_cpu.h"
+#include "renderer/scene.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+const int W = PHOTON_STREAM_WIDTH;
+
+// Lane-wise float and mask vectors. Every operation rounds like its scalar
+// counterpart, so a lane computes what the scalar tracer would.
+#if defined(__AVX2__)
+struct VFloat
+{
+    __m256 v;
+};
+struct VMask
+{
+    __m256 v;
+};
+
+inline VFloat vset(float x) { return {_mm256_set1_ps(x)}; }
+inline VFloat vload(const float *p) { return {_mm256_load_ps(p)}; }
+inline void vstore(float *p, VFloat a) { _mm256_store_ps(p, a.v); }
+inline VFloat operator+(VFloat a, VFloat b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline VFloat operator-(VFloat a, VFloat b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline VFloat operator*(VFloat a, VFloat b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline VFloat operator/(VFloat a, VFloat b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline VFloat operator-(VFloat a) { return {_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))}; }
+inline VFloat vsqrt(VFloat a) { return {_mm256_sqrt_ps(a.v)}; }
+inline VFloat vabs(VFloat a) { return {_mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v)}; }
+// std::max(a, b), including which operand a NaN yields.
+inline VFloat vmax(VFloat a, VFloat b) { return {_mm256_max_ps(b.v, a.v)}; }
+inline VMask operator<(VFloat a, VFloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+inline VMask operator<=(VFloat a, VFloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+inline VMask operator>=(VFloat a, VFloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)}; }
+inline VMask operator==(VFloat a, VFloat b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ)}; }
+inline VMask operator&(VMask a, VMask b) { return {_mm256_and_ps(a.v, b.v)}; }
+inline VMask operator|(VMask a, VMask b) { return {_mm256_or_ps(a.v, b.v)}; }
+// a && !b
+inline VMask andNot(VMask a, VMask b) { return {_mm256_andnot_ps(b.v, a.v)}; }
+inline VMask vnot(VMask a) { return {_mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))}; }
+inline VFloat select(VMask m, VFloat a, VFloat b) { return {_mm256_blendv_ps(b.v, a.v, m.v)}; }
+inline int laneBits(VMask m) { return _mm256_movemask_ps(m.v); }
+#elif defined(__SSE2__)
+// Two SSE halves of four lanes each.
+struct VFloat
+{
+    __m128 lo, hi;
+};
+struct VMask
+{
+    __m128 lo, hi;
+};
+
+inline VFloat vset(float x) { return {_mm_set1_ps(x), _mm_set1_ps(x)}; }
+inline VFloat vload(const float *p) { return {_mm_load_ps(p), _mm_load_ps(p + 4)}; }
+inline void vstore(float *p, VFloat a) { _mm_store_ps(p, a.lo), _mm_store_ps(p + 4, a.hi); }
+inline VFloat operator+(VFloat a, VFloat b) { return {_mm_add_ps(a.lo, b.lo), _mm_add_ps(a.hi, b.hi)}; }
+inline VFloat operator-(VFloat a, VFloat b) { return {_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi)}; }
+inline VFloat operator*(VFloat a, VFloat b) { return {_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)}; }
+inline VFloat operator/(VFloat a, VFloat b) { return {_mm_div_ps(a.lo, b.lo), _mm_div_ps(a.hi, b.hi)}; }
+inline VFloat operator-(VFloat a)
+{
+    __m128 sign = _mm_set1_ps(-0.0f);
+    return {_mm_xor_ps(a.lo, sign), _mm_xor_ps(a.hi, sign)};
+}
+inline VFloat vsqrt(VFloat a) { return {_mm_sqrt_ps(a.lo), _mm_sqrt_ps(a.hi)}; }
+inline VFloat vabs(VFloat a)
+{
+    __m128 sign = _mm_set1_ps(-0.0f);
+    return {_mm_andnot_ps(sign, a.lo), _mm_andnot_ps(sign, a.hi)};
+}
+inline VFloat vmax(VFloat a, VFloat b) { return {_mm_max_ps(b.lo, a.lo), _mm_max_ps(b.hi, a.hi)}; }
+inline VMask operator<(VFloat a, VFloat b) { return {_mm_cmplt_ps(a.lo, b.lo), _mm_cmplt_ps(a.hi, b.hi)}; }
+inline VMask operator<=(VFloat a, VFloat b) { return {_mm_cmple_ps(a.lo, b.lo), _mm_cmple_ps(a.hi, b.hi)}; }
+inline VMask operator>=(VFloat a, VFloat b) { return {_mm_cmpge_ps(a.lo, b.lo), _mm_cmpge_ps(a.hi, b.hi)}; }
+inline VMask operator==(VFloat a, VFloat b) { return {_mm_cmpeq_ps(a.lo, b.lo), _mm_cmpeq_ps(a.hi, b.hi)}; }
+inline VMask operator&(VMask a, VMask b) { return {_mm_and_ps(a.lo, b.lo), _mm_and_ps(a.hi, b.hi)}; }
+inline VMask operator|(VMask a, VMask b) { return {_mm_or_ps(a.lo, b.lo), _mm_or_ps(a.hi, b.hi)}; }
+inline VMask andNot(VMask a, VMask b) { return {_mm_andnot_ps(b.lo, a.lo), _mm_andnot_ps(b.hi, a.hi)}; }
+inline VMask vnot(VMask a)
+{
+    __m128 ones = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    return {_mm_xor_ps(a.lo, ones), _mm_xor_ps(a.hi, ones)};
+}
+inline VFloat select(VMask m, VFloat a, VFloat b)
+{
+    return {_mm_or_ps(_mm_and_ps(m.lo, a.lo), _mm_andnot_ps(m.lo, b.lo)),
+            _mm_or_ps(_mm_and_ps(m.hi, a.hi), _mm_andnot_ps(m.hi, b.hi))};
+}
+inline int laneBits(VMask m) { return _mm_movemask_ps(m.lo) | _mm_movemask_ps(m.hi) << 4; }
+#else
+struct VFloat
+{
+    float v[W];
+};
+struct VMask
+{
+    bool v[W];
+};
+
+template <typename F>
+inline VFloat lanewise(F f)
+{
+    VFloat r;
+    for (int l = 0; l < W; l++)
+        r.v[l] = f(l);
+    return r;
+}
+template <typename F>
+inline VMask maskwise(F f)
+{
+    VMask r;
+    for (int l = 0; l < W; l++)
+        r.v[l] = f(l);
+    return r;
+}
+
+inline VFloat vset(float x) { return lanewise([&](int) { return x; }); }
+inline VFloat vload(const float *p) { return lanewise([&](int l) { return p[l]; }); }
+inline void vstore(float *p, VFloat a) { std::copy(a.v, a.v + W, p); }
+inline VFloat operator+(VFloat a, VFloat b) { return lanewise([&](int l) { return a.v[l] + b.v[l]; }); }
+inline VFloat operator-(VFloat a, VFloat b) { return lanewise([&](int l) { return a.v[l] - b.v[l]; }); }
+inline VFloat operator*(VFloat a, VFloat b) { return lanewise([&](int l) { return a.v[l] * b.v[l]; }); }
+inline VFloat operator/(VFloat a, VFloat b) { return lanewise([&](int l) { return a.v[l] / b.v[l]; }); }
+inline VFloat operator-(VFloat a) { return lanewise([&](int l) { return -a.v[l]; }); }
+inline VFloat vsqrt(VFloat a) { return lanewise([&](int l) { return std::sqrt(a.v[l]); }); }
+inline VFloat vabs(VFloat a) { return lanewise([&](int l) { return std::abs(a.v[l]); }); }
+inline VFloat vmax(VFloat a, VFloat b) { return lanewise([&](int l) { return std::max(a.v[l], b.v[l]); }); }
+inline VMask operator<(VFloat a, VFloat b) { return maskwise([&](int l) { return a.v[l] < b.v[l]; }); }
+inline VMask operator<=(VFloat a, VFloat b) { return maskwise([&](int l) { return a.v[l] <= b.v[l]; }); }
+inline VMask operator>=(VFloat a, VFloat b) { return maskwise([&](int l) { return a.v[l] >= b.v[l]; }); }
+inline VMask operator==(VFloat a, VFloat b) { return maskwise([&](int l) { return a.v[l] == b.v[l]; }); }
+inline VMask operator&(VMask a, VMask b) { return maskwise([&](int l) { return a.v[l] && b.v[l]; }); }
+inline VMask operator|(VMask a, VMask b) { return maskwise([&](int l) { return a.v[l] || b.v[l]; }); }
+inline VMask andNot(VMask a, VMask b) { return maskwise([&](int l) { return a.v[l] && !b.v[l]; }); }
+inline VMask vnot(VMask a) { return maskwise([&](int l) { return !a.v[l]; }); }
+inline VFloat select(VMask m, VFloat a, VFloat b) { return lanewise([&](int l) { return m.v[l] ? a.v[l] : b.v[l]; }); }
+inline int laneBits(VMask m)
+{
+    int bits = 0;
+    for (int l = 0; l < W; l++)
+        bits |= m.v[l] << l;
+    return bits;
+}
+#endif
+
+struct VVec3
+{
+    VFloat x, y, z;
+};
+
+inline VVec3 operator+(const VVec3 &a, const VVec3 &b) { return {a.x + b.x, a.y + b.y, a.z + b.z}; }
+inline VVec3 operator-(const VVec3 &a, const VVec3 &b) { return {a.x - b.x, a.y - b.y, a.z - b.z}; }
+inline VVec3 operator*(const VVec3 &a, VFloat t) { return {a.x * t, a.y * t, a.z * t}; }
+inline VVec3 operator-(const VVec3 &a) { return {-a.x, -a.y, -a.z}; }
+inline VFloat dot(const VVec3 &a, const VVec3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline VVec3 select(VMask m, const VVec3 &a, const VVec3 &b)
+{
+    return {select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z)};
+}
+inline VVec3 normalize(const VVec3 &a)
+{
+    VFloat l = vsqrt(dot(a, a));
+    VMask positive = vset(0.0f) < l;
+    VFloat zero = vset(0.0f);
+    return {select(positive, a.x / l, zero), select(positive, a.y / l, zero),
+            select(positive, a.z / l, zero)};
+}
+
+// Nearest hit of every lane's ray among the scene's planes and spheres (the
+// light excluded), as intersectScene(ro, rd, hit, false) finds it. Lanes
+// without a hit keep material -1.
+struct StreamHit
+{
+    VFloat t;
+    VVec3 point, normal;
+    VFloat u, v;
+    VFloat material, textureId, primitive;
+};
+
+void intersectStream(const VVec3 &o, const VVec3 &d, StreamHit &hit)
+{
+    VFloat zero = vset(0.0f);
+    hit.t = vset(1e30f);
+    hit.point = hit.normal = {zero, zero, zero};
+    hit.u = hit.v = zero;
+    hit.material = hit.textureId = hit.primitive = vset(-1.0f);
+
+    const VFloat *oa[3] = {&o.x, &o.y, &o.z};
+    const VFloat *da[3] = {&d.x, &d.y, &d.z};
+    VFloat minT = vset(0.001f);
+
+    for (int i = 0; i < SCENE_PLANE_COUNT; i++)
+    {
+        ScenePlane plane = scenePlane(i);
+        // The normal is +-1 along the axis; its sign cancels out of t.
+        VFloat denom = *da[plane.axis];
+        VFloat t = (vset(plane.offset) - *oa[plane.axis]) / denom;
+        VMask miss = (vabs(denom) < vset(0.0001f)) | (t < minT) | (t >= hit.t);
+
+        VVec3 p = o + d * t;
+        const VFloat *pa[3] = {&p.x, &p.y, &p.z};
+        VFloat pu = *pa[plane.uAxis], pv = *pa[plane.vAxis];
+        VMask inBounds = (vset(plane.minU) <= pu) & (pu <= vset(plane.maxU)) &
+                         (vset(plane.minV) <= pv) & (pv <= vset(plane.maxV));
+        VMask take = andNot(inBounds, miss);
+        if (!laneBits(take))
+            continue;
+
+        VFloat sign = vset(plane.normalSign);
+        VVec3 normal = {plane.axis == 0 ? sign : zero, plane.axis == 1 ? sign : zero,
+                        plane.axis == 2 ? sign : zero};
+        hit.t = select(take, t, hit.t);
+        hit.point = select(take, p, hit.point);
+        hit.normal = select(take, normal, hit.normal);
+        hit.u = select(take, (pu - vset(plane.minU)) / vset(plane.maxU - plane.minU), hit.u);
+        hit.v = select(take, (pv - vset(plane.minV)) / vset(plane.maxV - plane.minV), hit.v);
+        hit.material = select(take, vset((float)plane.material), hit.material);
+        hit.textureId = select(take, vset((float)plane.textureId), hit.textureId);
+        hit.primitive = select(take, vset((float)i), hit.primitive);
+    }
+
+    for (int i = 0; i < SCENE_SPHERE_COUNT; i++)
+    {
+        const SceneSphere &sphere = sceneSphere(i);
+        VVec3 center = {vset(sphere.center.x), vset(sphere.center.y), vset(sphere.center.z)};
+        VVec3 oc = o - center;
+        VFloat a = dot(d, d);
+        VFloat b = dot(oc, d);
+        VFloat c = dot(oc, oc) - vset(sphere.radius * sphere.radius);
+        VFloat disc = b * b - a * c;
+        VFloat root = vsqrt(disc);
+        VFloat t = (-b - root) / a;
+        t = select(t < minT, (-b + root) / a, t);
+        VMask take = vnot((disc < zero) | (t < minT) | (t >= hit.t));
+        if (!laneBits(take))
+            continue;
+
+        VVec3 p = o + d * t;
+        hit.t = select(take, t, hit.t);
+        hit.point = select(take, p, hit.point);
+        hit.normal = select(take, normalize(p - center), hit.normal);
+        hit.u = select(take, zero, hit.u);
+        hit.v = select(take, zero, hit.v);
+        hit.material = select(take, vset((float)sphere.material), hit.material);
+        hit.textureId = select(take, vset(-1.0f), hit.textureId);
+        hit.primitive = select(take, vset((float)sphere.primitive), hit.primitive);
+    }
+}
+
+// fresnelDielectric(cosThetaI, etaI, etaT) per lane.
+VFloat fresnelStream(VFloat cosThetaI, float etaIn, float etaOut)
+{
+    VFloat one = vset(1.0f);
+    cosThetaI = select(cosThetaI < vset(-1.0f), vset(-1.0f), select(one < cosThetaI, one, cosThetaI));
+
+    VMask swap = cosThetaI < vset(0.0f);
+    VFloat etaI = select(swap, vset(etaOut), vset(etaIn));
+    VFloat etaT = select(swap, vset(etaIn), vset(etaOut));
+    cosThetaI = select(swap, -cosThetaI, cosThetaI);
+
+    VFloat sinThetaI = vsqrt(vmax(vset(0.0f), one - cosThetaI * cosThetaI));
+    VFloat sinThetaT = etaI / etaT * sinThetaI;
+    VMask total = sinThetaT >= one;
+
+    VFloat cosThetaT = vsqrt(vmax(vset(0.0f), one - sinThetaT * sinThetaT));
+    VFloat rParl = ((etaT * cosThetaI) - (etaI * cosThetaT)) / ((etaT * cosThetaI) + (etaI * cosThetaT));
+    VFloat rPerp = ((etaI * cosThetaI) - (etaT * cosThetaT)) / ((etaI * cosThetaI) + (etaT * cosThetaT));
+
+    return select(total, one, (rParl * rParl + rPerp * rPerp) / vset(2.0f));
+}
+
+// reflectVec per lane.
+VVec3 reflectStream(const VVec3 &v, const VVec3 &n)
+{
+    return v - n * (vset(2.0f) * dot(v, n));
+}
+
+// refractVec per lane; zero where the ray is totally reflected.
+VVec3 refractStream(const VVec3 &wi, VVec3 n, VFloat eta)
+{
+    VFloat cosThetaI = dot(-wi, n);
+    VMask flip = cosThetaI < vset(0.0f);
+    n = select(flip, -n, n);
+    cosThetaI = select(flip, -cosThetaI, cosThetaI);
+
+    VFloat sin2ThetaI = vmax(vset(0.0f), vset(1.0f) - cosThetaI * cosThetaI);
+    VFloat sin2ThetaT = eta * eta * sin2ThetaI;
+    VMask total = sin2ThetaT >= vset(1.0f);
+
+    VFloat cosThetaT = vsqrt(vset(1.0f) - sin2ThetaT);
+    VVec3 refracted = wi * eta + n * (eta * cosThetaI - cosThetaT);
+    VVec3 zero = {vset(0.0f), vset(0.0f), vset(0.0f)};
+    return select(total, zero, refracted);
+}
+
+struct alignas(32) LaneArrays
+{
+    float ox[W], oy[W], oz[W];
+    float dx[W], dy[W], dz[W];
+    float px[W], py[W], pz[W];
+
+    VVec3 origin() const { return {vload(ox), vload(oy), vload(oz)}; }
+    VVec3 direction() const { return {vload(dx), vload(dy), vload(dz)}; }
+    VVec3 power() const { return {vload(px), vload(py), vload(pz)}; }
+    void setOrigin(const VVec3 &v) { vstore(ox, v.x), vstore(oy, v.y), vstore(oz, v.z); }
+    void setDirection(const VVec3 &v) { vstore(dx, v.x), vstore(dy, v.y), vstore(dz, v.z); }
+    void setPower(const VVec3 &v) { vstore(px, v.x), vstore(py, v.y), vstore(pz, v.z); }
+};
+
+struct alignas(32) HitArrays
+{
+    float x[W], y[W], z[W];
+    float nx[W], ny[W], nz[W];
+    float u[W], v[W];
+    float material[W], textureId[W], primitive[W];
+
+    void set(const StreamHit &hit)
+    {
+        vstore(x, hit.point.x), vstore(y, hit.point.y), vstore(z, hit.point.z);
+        vstore(nx, hit.normal.x), vstore(ny, hit.normal.y), vstore(nz, hit.normal.z);
+        vstore(u, hit.u), vstore(v, hit.v);
+        vstore(material, hit.material), vstore(textureId, hit.textureId), vstore(primitive, hit.primitive);
+    }
+};
+}
+
+void tracePhotonStream(PhotonPathRule rule, int first, int last, uint32_t seed,
+                       uint64_t firstStream, const SampleSequence *sequence,
+                       const PhotonEmitFn &emit, std::vector<TracedPhoton> &out)
+{
+    const bool caustic = rule == PhotonPathRule::Caustic;
+    const int maxBounces = caustic ? 20 : 10;
+    const float ior = 1.5f;
+    size_t outStart = out.size();
+
+    LaneArrays lanes = {};
+    std::vector<PhotonSampler> samplers(W, PhotonSampler(CounterRng(seed, 0)));
+    int emission[W], bounce[W];
+    // Caustic paths: a specular surface was hit. Global: a diffuse one was.
+    bool flag[W];
+    int activeBits = 0;
+    int next = first;
+
+    auto refill = [&](int l)
+    {
+        activeBits &= ~(1 << l);
+        while (next < last)
+        {
+            int i = next++;
+            PhotonSampler sampler = photonSampler(sequence, seed, firstStream, i);
+            Vec3 o, d, p;
+            if (!emit(i, sampler, o, d, p))
+                continue;
+            lanes.ox[l] = o.x, lanes.oy[l] = o.y, lanes.oz[l] = o.z;
+            lanes.dx[l] = d.x, lanes.dy[l] = d.y, lanes.dz[l] = d.z;
+            lanes.px[l] = p.x, lanes.py[l] = p.y, lanes.pz[l] = p.z;
+            samplers[l] = sampler;
+            emission[l] = i;
+            bounce[l] = 0;
+            flag[l] = false;
+            activeBits |= 1 << l;
+            return;
+        }
+    };
+    for (int l = 0; l < W; l++)
+        refill(l);
+
+    while (activeBits)
+    {
+        VVec3 o = lanes.origin();
+        VVec3 d = lanes.direction();
+        VVec3 power = lanes.power();
+        StreamHit hit;
+        intersectStream(o, d, hit);
+        HitArrays hits;
+        hits.set(hit);
+
+        VMask mirror = hit.material == vset(2.0f);
+        VMask glass = hit.material == vset(1.0f);
+        int glassBits = laneBits(glass) & activeBits;
+        int specularBits = (laneBits(mirror) & activeBits) | glassBits;
+
+        if (specularBits)
+        {
+            VVec3 offset = hit.normal * vset(0.001f);
+            VVec3 newO = hit.point + offset;
+            VVec3 newD = reflectStream(d, hit.normal);
+
+            if (glassBits)
+            {
+                // One Fresnel draw per glass lane, as the scalar tracer makes.
+                alignas(32) float xi[W] = {};
+                for (int l = 0; l < W; l++)
+                {
+                    if (glassBits & (1 << l))
+                        xi[l] = samplers[l].get(photonBounceDimension(bounce[l], 0));
+                }
+
+                VMask entering = dot(d, hit.normal) < vset(0.0f);
+                VVec3 n = select(entering, hit.normal, -hit.normal);
+                VFloat eta = select(entering, vset(1.0f / ior), vset(ior));
+                VFloat fr = fresnelStream(dot(-d, n), 1.0f, ior);
+
+                VVec3 refracted = refractStream(d, n, eta);
+                VMask reflect = (vload(xi) < fr) | (dot(refracted, refracted) < vset(0.001f));
+                VVec3 nOffset = n * vset(0.001f);
+                VVec3 glassO = select(reflect, hit.point + nOffset, hit.point - nOffset);
+                VVec3 glassD = select(reflect, reflectStream(d, n), normalize(refracted));
+
+                newO = select(glass, glassO, newO);
+                newD = select(glass, glassD, newD);
+            }
+
+            VMask specular = mirror | glass;
+            VFloat scale = select(glass, vset(0.99f), vset(0.95f));
+            lanes.setOrigin(select(specular, newO, o));
+            lanes.setDirection(select(specular, newD, d));
+            lanes.setPower(select(specular, power * scale, power));
+        }
+
+        for (int l = 0; l < W; l++)
+        {
+            if (!(activeBits & (1 << l)))
+                continue;
+
+            int material = (int)hits.material[l];
+            bool alive;
+            if (material < 0)
+            {
+                alive = false;
+            }
+            else if (specularBits & (1 << l))
+            {
+                if (caustic)
+                    flag[l] = true;
+                alive = true;
+            }
+            else if (material == 0 || material == 3 || material == 4)
+            {
+                Vec3 point(hits.x[l], hits.y[l], hits.z[l]);
+                Vec3 normal(hits.nx[l], hits.ny[l], hits.nz[l]);
+                Vec3 rd(lanes.dx[l], lanes.dy[l], lanes.dz[l]);
+                Vec3 p(lanes.px[l], lanes.py[l], lanes.pz[l]);
+                int textureId = (int)hits.textureId[l];
+                Vec3 color = getMaterialColor(material, hits.u[l], hits.v[l], textureId);
+
+                if (flag[l])
+                    out.push_back({point, p * color, (-rd).normalize(), normal, (int)hits.primitive[l],
+                                   emission[l]});
+
+                if (caustic)
+                {
+                    alive = false;
+                }
+                else
+                {
+                    flag[l] = true;
+                    float survivalProb = std::max(getMaterialColor(material).x,
+                                                  std::max(getMaterialColor(material).y,
+                                                           getMaterialColor(material).z));
+                    alive = !(samplers[l].get(photonBounceDimension(bounce[l], 0)) > survivalProb);
+                    if (alive)
+                    {
+                        p = p * (1.0f / survivalProb);
+                        float r1 = samplers[l].get(photonBounceDimension(bounce[l], 1));
+                        float r2 = samplers[l].get(photonBounceDimension(bounce[l], 2));
+                        rd = cosineWeightedHemisphere(normal, r1, r2);
+                        Vec3 ro = point + normal * 0.001f;
+                        p = p * color;
+                        lanes.ox[l] = ro.x, lanes.oy[l] = ro.y, lanes.oz[l] = ro.z;
+                        lanes.dx[l] = rd.x, lanes.dy[l] = rd.y, lanes.dz[l] = rd.z;
+                        lanes.px[l] = p.x, lanes.py[l] = p.y, lanes.pz[l] = p.z;
+                    }
+                }
+            }
+            else
+            {
+                // Global paths retry the same ray, as the scalar loop does.
+                alive = !caustic;
+            }
+
+            if (alive && ++bounce[l] >= maxBounces)
+                alive = false;
+            if (!alive)
+                refill(l);
+        }
+    }
+
+    std::stable_sort(out.begin() + outStart, out.end(),
+                     [](const TracedPhoton &a, const TracedPhoton &b)
+                     { return a.emission < b.emission; });
+}
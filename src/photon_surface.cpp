@@ -0,0 +1,155 @@
+#include "renderer/photon_surface.h"
+#include "renderer/photon_direction.h"
+#include <algorithm>
+#include <cmath>
+
+void SurfacePhotonMap::store(const Vec3 &pos, const Vec3 &power, const Vec3 &inDir,
+                             const Vec3 &normal, int primitive)
+{
+    Photon p;
+    p.position = pos;
+    p.power = power;
+    p.incomingDir = inDir;
+    p.axis = 0;
+    encodePhotonDirection(normal, p.normalTheta, p.normalPhi);
+
+    bool planar = primitive >= 0 && primitive < SCENE_PLANE_COUNT;
+    pending[planar ? primitive : SCENE_PLANE_COUNT].push_back(p);
+}
+
+void SurfacePhotonMap::scalePower(float factor)
+{
+    for (std::vector<Photon> &surface : pending)
+    {
+        for (Photon &p : surface)
+            p.power = p.power * factor;
+    }
+    for (Photon &p : photons)
+        p.power = p.power * factor;
+}
+
+void SurfacePhotonMap::balance()
+{
+    // Rebuilds everything; photons balanced earlier rejoin their surface.
+    size_t otherStart = surfaceEnd[SCENE_PLANE_COUNT - 1];
+    for (int s = 0; s < SCENE_PLANE_COUNT; s++)
+        pending[s].insert(pending[s].end(), photons.begin() + surfaceStart[s],
+                          photons.begin() + surfaceEnd[s]);
+    pending[SCENE_PLANE_COUNT].insert(pending[SCENE_PLANE_COUNT].end(), photons.begin() + otherStart,
+                                      photons.end());
+    photons.clear();
+    nodes.clear();
+
+    struct BuildNode
+    {
+        Vec3 position;
+        short axis;
+        uint32_t index;
+    };
+
+    for (int s = 0; s < SCENE_PLANE_COUNT; s++)
+    {
+        ScenePlane plane = scenePlane(s);
+        std::vector<BuildNode> build(pending[s].size());
+        for (size_t i = 0; i < build.size(); i++)
+        {
+            const Vec3 &p = pending[s][i].position;
+            build[i].position = Vec3(p[plane.uAxis], p[plane.vAxis], 0.0f);
+            build[i].axis = 0;
+            build[i].index = (uint32_t)i;
+        }
+        kdBalance(build, cancelFlag);
+
+        surfaceStart[s] = photons.size();
+        for (const BuildNode &b : build)
+        {
+            photons.push_back(pending[s][b.index]);
+            nodes.push_back({b.position, b.axis});
+        }
+        surfaceEnd[s] = photons.size();
+        std::vector<Photon>().swap(pending[s]);
+    }
+
+    std::vector<Photon> &other = pending[SCENE_PLANE_COUNT];
+    kdBalance(other, cancelFlag);
+    photons.insert(photons.end(), other.begin(), other.end());
+    std::vector<Photon>().swap(other);
+}
+
+size_t SurfacePhotonMap::size() const
+{
+    size_t count = photons.size();
+    for (const std::vector<Photon> &p : pending)
+        count += p.size();
+    return count;
+}
+
+void SurfacePhotonMap::locateOnSurface(int surface, const Vec3 &query, int maxPhotons,
+                                       float &maxDistSq, PhotonHeap &heap) const
+{
+    size_t start = surfaceStart[surface];
+    const Node *base = nodes.data() + start;
+    const Photon *surfacePhotons = photons.data() + start;
+    kdLocateNearest(base, surfaceEnd[surface] - start, query, maxDistSq,
+                    [&](const Node &n, float distSq)
+                    {
+                        heap.push(distSq, &surfacePhotons[&n - base], maxPhotons, maxDistSq);
+                    },
+                    farScaleSq);
+}
+
+void SurfacePhotonMap::locatePhotons(const Vec3 &pos, int maxPhotons, float &maxDistSq,
+                                     PhotonHeap &heap) const
+{
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+
+    int onSurface = -1;
+    float nearest = SURFACE_PLANE_EPSILON;
+    for (int s = 0; s < SCENE_PLANE_COUNT; s++)
+    {
+        ScenePlane plane = scenePlane(s);
+        float d = std::fabs(pos[plane.axis] - plane.offset);
+        if (d <= nearest)
+        {
+            nearest = d;
+            onSurface = s;
+        }
+    }
+    if (onSurface >= 0)
+    {
+        ScenePlane plane = scenePlane(onSurface);
+        locateOnSurface(onSurface, Vec3(pos[plane.uAxis], pos[plane.vAxis], 0.0f), maxPhotons,
+                        maxDistSq, heap);
+        return;
+    }
+
+    // Off every plane: the plane distance as third coordinate makes each
+    // tree's squared distances the true 3D ones. Nearer planes go first so
+    // the radius shrinks early, and planes beyond it are skipped.
+    int order[SCENE_PLANE_COUNT];
+    float planeDistSq[SCENE_PLANE_COUNT];
+    for (int s = 0; s < SCENE_PLANE_COUNT; s++)
+    {
+        ScenePlane plane = scenePlane(s);
+        float d = pos[plane.axis] - plane.offset;
+        planeDistSq[s] = d * d;
+        order[s] = s;
+    }
+    std::sort(order, order + SCENE_PLANE_COUNT,
+              [&](int a, int b) { return planeDistSq[a] < planeDistSq[b]; });
+    for (int s : order)
+    {
+        if (planeDistSq[s] >= maxDistSq)
+            break;
+        ScenePlane plane = scenePlane(s);
+        locateOnSurface(s, Vec3(pos[plane.uAxis], pos[plane.vAxis], pos[plane.axis] - plane.offset),
+                        maxPhotons, maxDistSq, heap);
+    }
+    size_t otherStart = surfaceEnd[SCENE_PLANE_COUNT - 1];
+    kdLocateNearest(photons.data() + otherStart, photons.size() - otherStart, pos, maxDistSq,
+                    [&](const Photon &p, float distSq)
+                    {
+                        heap.push(distSq, &p, maxPhotons, maxDistSq);
+                    },
+                    farScaleSq);
+}
@@ -0,0 +1,140 @@
+#include "renderer/photon_veb.h"
+#include "renderer/photon_map.h"
+#include <algorithm>
+
+// Appends the heap indices of the subtree of `height` levels under `root`
+// in van Emde Boas order.
+static void vebOrder(size_t root, int height, size_t count, std::vector<uint32_t> &order)
+{
+    if (root >= count)
+        return;
+    if (height == 1)
+    {
+        order.push_back((uint32_t)root);
+        return;
+    }
+
+    int top = height / 2;
+    vebOrder(root, top, count, order);
+
+    // In heap order the descendants of `root` at depth d are contiguous and
+    // start at (root + 1) * 2^d - 1.
+    size_t first = ((root + 1) << top) - 1;
+    for (size_t k = 0; k < ((size_t)1 << top) && first + k < count; k++)
+        vebOrder(first + k, height - top, count, order);
+}
+
+// Nodes PhotonVebTree::build fills between checks of its cancel flag.
+static const size_t VEB_CANCEL_CHECK = 1 << 16;
+
+void PhotonVebTree::build(const Photon *photons, size_t count, const std::atomic<bool> *cancel)
+{
+    nodes.clear();
+    if (count == 0)
+        return;
+    // Heap indices must fit beside the axis bits; an empty skeleton makes
+    // PhotonMap fall back to the heap-order walk.
+    if (count > INDEX_MASK)
+        return;
+
+    int height = 0;
+    while (((size_t)1 << height) - 1 < count)
+        height++;
+
+    std::vector<uint32_t> order;
+    order.reserve(count);
+    vebOrder(0, height, count, order);
+
+    std::vector<uint32_t> position(count);
+    for (size_t i = 0; i < count; i++)
+        position[order[i]] = (uint32_t)i;
+
+    nodes.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i % VEB_CANCEL_CHECK == 0 && cancel && *cancel)
+        {
+            nodes.clear();
+            return;
+        }
+        size_t heapIndex = order[i];
+        size_t left = 2 * heapIndex + 1;
+        size_t right = 2 * heapIndex + 2;
+        const Photon &p = photons[heapIndex];
+        nodes[i].position[0] = p.position.x;
+        nodes[i].position[1] = p.position.y;
+        nodes[i].position[2] = p.position.z;
+        nodes[i].photon = (uint32_t)heapIndex | ((uint32_t)p.axis << AXIS_SHIFT);
+        nodes[i].left = left < count ? position[left] : NO_CHILD;
+        nodes[i].right = right < count ? position[right] : NO_CHILD;
+    }
+}
+
+void PhotonVebTree::locatePhotons(const Photon *photons, const Vec3 &pos, int maxPhotons,
+                                  float &maxDistSq, BasicPhotonHeap<Photon> &heap,
+                                  float farScaleSq, PhotonQueryStats *stats) const
+{
+    (void)stats;
+    if (nodes.empty())
+        return;
+    maxPhotons = std::min(maxPhotons, MAX_GATHER_PHOTONS);
+
+    struct StackEntry
+    {
+        uint32_t index;
+        float planeDistSq;
+    };
+    StackEntry stack[PHOTON_STACK_DEPTH];
+    int stackSize = 0;
+
+    uint32_t index = 0;
+
+    while (true)
+    {
+        while (index != NO_CHILD)
+        {
+            const Node &node = nodes[index];
+            // Both children are likely to be visited; start fetching them
+            // while this node is being processed.
+            if (node.left != NO_CHILD)
+                __builtin_prefetch(&nodes[node.left]);
+            if (node.right != NO_CHILD)
+                __builtin_prefetch(&nodes[node.right]);
+
+            int axis = node.photon >> AXIS_SHIFT;
+            float delta = pos[axis] - node.position[axis];
+
+            float dx = pos.x - node.position[0];
+            float dy = pos.y - node.position[1];
+            float dz = pos.z - node.position[2];
+            float distSq = dx * dx + dy * dy + dz * dz;
+            PHOTON_STAT(if (stats) { stats->nodesVisited++; stats->distanceTests++; });
+            if (distSq < maxDistSq)
+                heap.push(distSq, &photons[node.photon & INDEX_MASK], maxPhotons, maxDistSq);
+
+            uint32_t nearChild = (delta < 0) ? node.left : node.right;
+            uint32_t farChild = (delta < 0) ? node.right : node.left;
+
+            if (farChild != NO_CHILD)
+            {
+                stack[stackSize].index = farChild;
+                stack[stackSize].planeDistSq = delta * delta * farScaleSq;
+                stackSize++;
+            }
+            index = nearChild;
+        }
+
+        while (stackSize > 0)
+        {
+            const StackEntry &e = stack[--stackSize];
+            if (e.planeDistSq < maxDistSq)
+            {
+                PHOTON_STAT(if (stats) stats->farDescents++);
+                index = e.index;
+                break;
+            }
+        }
+        if (index == NO_CHILD)
+            break;
+    }
+}
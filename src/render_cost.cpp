@@ -0,0 +1,103 @@
+#include "renderer/render_cost.h"
+#include "renderer/renderer_cpu.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+thread_local PixelCost *activePixelCost = nullptr;
+
+void renderCostFrame(const CPUCamera &cam, const PhotonMapBackend &causticMap,
+                     const PhotonMapBackend &globalMap, int frameIndex,
+                     std::vector<PixelCost> &costs)
+{
+    float aspectRatio = static_cast<float>(WIDTH) / static_cast<float>(HEIGHT);
+    float scale = std::tan(40.0f * 0.5f * PI / 180.0f);
+    costs.assign((size_t)WIDTH * HEIGHT, PixelCost());
+
+#pragma omp parallel for schedule(dynamic)
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            PixelSampler sampler = pixelSampler(x, y, frameIndex);
+            float px = ((static_cast<float>(x) + 0.5f) / WIDTH * 2.0f - 1.0f) * aspectRatio * scale;
+            float py = ((static_cast<float>(y) + 0.5f) / HEIGHT * 2.0f - 1.0f) * scale;
+
+            PixelCost &cost = costs[(size_t)y * WIDTH + x];
+            activePixelCost = &cost;
+            renderPixel(px, py, cam, causticMap, globalMap, sampler);
+            activePixelCost = nullptr;
+        }
+    }
+}
+
+// Blue -> cyan -> green -> yellow -> red for t in [0, 1].
+static Vec3 heatColor(float t)
+{
+    t = std::min(std::max(t, 0.0f), 1.0f) * 4.0f;
+    int segment = std::min((int)t, 3);
+    float f = t - segment;
+    switch (segment)
+    {
+    case 0:
+        return Vec3(0, f, 1);
+    case 1:
+        return Vec3(0, 1, 1 - f);
+    case 2:
+        return Vec3(f, 1, 0);
+    default:
+        return Vec3(1, 1 - f, 0);
+    }
+}
+
+void costHeatmap(const std::vector<PixelCost> &costs, std::vector<unsigned char> &frameData)
+{
+    bool nodesCounted = false;
+    uint32_t maxCost = 0;
+    for (const PixelCost &c : costs)
+        nodesCounted = nodesCounted || c.photonNodes > 0;
+    for (const PixelCost &c : costs)
+        maxCost = std::max(maxCost, nodesCounted ? c.photonNodes : c.intersections);
+
+    float logMax = std::log1p((float)maxCost);
+    frameData.resize(costs.size() * 3);
+    for (size_t i = 0; i < costs.size(); i++)
+    {
+        uint32_t value = nodesCounted ? costs[i].photonNodes : costs[i].intersections;
+        Vec3 color = heatColor(logMax > 0 ? std::log1p((float)value) / logMax : 0.0f);
+        frameData[i * 3 + 0] = static_cast<unsigned char>(color.x * 255.0f);
+        frameData[i * 3 + 1] = static_cast<unsigned char>(color.y * 255.0f);
+        frameData[i * 3 + 2] = static_cast<unsigned char>(color.z * 255.0f);
+    }
+
+    std::cout << "Cost heatmap of " << (nodesCounted ? "photon nodes visited" : "intersectScene calls")
+              << ", max " << maxCost << " per pixel\n";
+}
+
+void saveCostBuffer(const std::vector<PixelCost> &costs, int width, int height,
+                    const char *filename)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "Failed to create " << filename << std::endl;
+        return;
+    }
+
+    std::vector<float> row(width * 3);
+    for (int y = height - 1; y >= 0; --y)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const PixelCost &c = costs[(size_t)y * width + x];
+            row[x * 3 + 0] = (float)c.photonNodes;
+            row[x * 3 + 1] = (float)c.intersections;
+            row[x * 3 + 2] = (float)c.maxDepth;
+        }
+        file.write(reinterpret_cast<const char *>(row.data()), row.size() * sizeof(float));
+    }
+
+    std::cout << "Saved " << width << "x" << height << " cost buffer (3 floats per pixel) to "
+              << filename << std::endl;
+}
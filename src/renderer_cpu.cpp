@@ -4,11 +4,25 @@
 #include <cmath>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <climits>
 #include "renderer/camera.h"
+#include "renderer/photon_importance.h"
+#include "renderer/photon_projection.h"
+#include "renderer/photon_stream.h"
+#include "renderer/render_cost.h"
 extern bool texturesEnabled;
 extern Texture floorTexture;
 extern Texture backWallTexture;
 extern Texture ceilingTexture;
+bool bucketedGather = false;
+int gatherPhotonCount = MAX_GATHER_PHOTONS;
+bool irradianceGather = true;
+bool rangeGather = false;
+bool vebGather = false;
+bool streamPhotonTracing = true;
+SamplerType samplerType = SamplerType::Random;
+std::atomic<bool> cancelPhotonTracing{false};
 float fresnelDielectric(float cosThetaI, float etaI, float etaT)
 {
     cosThetaI = std::clamp(cosThetaI, -1.0f, 1.0f);
@@ -59,6 +73,20 @@ Vec3 reflectVec(Vec3 v, Vec3 n)
     return v - 2.0f * v.dot(n) * n;
 }
 
+Vec3 cosineWeightedHemisphere(const Vec3 &normal, float r1, float r2)
+{
+    float z = std::sqrt(1.0f - r2);
+    float phi = 2.0f * PI * r1;
+    float x = std::cos(phi) * std::sqrt(r2);
+    float y = std::sin(phi) * std::sqrt(r2);
+
+    Vec3 tangent = std::abs(normal.y) > 0.9f ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
+    Vec3 bitangent = normal.cross(tangent).normalize();
+    tangent = bitangent.cross(normal);
+
+    return (tangent * x + normal * z + bitangent * y).normalize();
+}
+
 float schlickBRDF(const Vec3 &n, const Vec3 &wo, const Vec3 &wi, float alpha)
 {
     float v = std::max(n.dot(wo), 0.001f);
@@ -85,208 +113,401 @@ float schlickBRDF(const Vec3 &n, const Vec3 &wo, const Vec3 &wi, float alpha)
 
     return diffuse + specular;
 }
-Vec3 cosineWeightedHemisphere(const Vec3 &normal, std::mt19937 &rng)
+
+static Vec3 photonPower(const Photon &p) { return p.power; }
+static Vec3 photonDirection(const Photon &p) { return p.incomingDir; }
+
+// Power a photon reflects towards wo, before dividing by the gather area.
+template <typename P>
+static Vec3 photonReflected(const P &p, const Vec3 &normal, const Vec3 &wo, float alpha)
 {
-    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
-    float r1 = dist(rng);
-    float r2 = dist(rng);
+    Vec3 incomingDir = photonDirection(p);
 
-    float z = std::sqrt(1.0f - r2);
-    float phi = 2.0f * PI * r1;
-    float x = std::cos(phi) * std::sqrt(r2);
-    float y = std::sin(phi) * std::sqrt(r2);
+    float nDotWi = normal.dot(incomingDir);
+    if (nDotWi <= 0)
+        return Vec3(0, 0, 0);
 
-    Vec3 tangent = std::abs(normal.y) > 0.9f ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
-    Vec3 bitangent = normal.cross(tangent).normalize();
-    tangent = bitangent.cross(normal);
+    float brdf = schlickBRDF(normal, wo, incomingDir, alpha);
+    return photonPower(p) * brdf;
+}
 
-    return (tangent * x + normal * z + bitangent * y).normalize();
+// Density estimate over all photons within a fixed radius, accumulated while
+// the tree is walked.
+static Vec3 rangeEstimate(const PhotonMap &map, const Vec3 &pos, const Vec3 &normal,
+                          const Vec3 &wo, int material, float u, float v, int textureId,
+                          float radius)
+{
+    Vec3 result(0, 0, 0);
+    float alpha = getMaterialAlpha(material);
+    map.locatePhotonsInRadius(pos, radius * radius,
+                              [&](const Photon &p, float)
+                              {
+                                  result += photonReflected(p, normal, wo, alpha);
+                              });
+
+    return result * (1.0f / (PI * radius * radius)) * getMaterialColor(material, u, v, textureId);
 }
 
-Vec3 radianceEstimate(const PhotonMap &map, const Vec3 &pos, const Vec3 &normal,
+template <typename Heap>
+static Vec3 shadeGatheredPhotons(const Heap &heap, const Vec3 &normal, const Vec3 &wo,
+                                 int material, float u, float v, int textureId)
+{
+    if (heap.empty())
+        return Vec3(0, 0, 0);
+
+    Vec3 result(0, 0, 0);
+    float alpha = getMaterialAlpha(material);
+    Vec3 albedo = getMaterialColor(material, u, v, textureId);
+
+    float finalRadiusSq = heap.maxDistSq();
+
+    for (int i = 0; i < heap.size(); i++)
+        result += photonReflected(*heap.entries[i].photon, normal, wo, alpha);
+
+    float area = PI * finalRadiusSq;
+    if (area > 0)
+    {
+        result = result * (1.0f / area);
+    }
+
+    return result * albedo;
+}
+
+// Lambertian radiance from the nearest precomputed irradiance photon, when the
+// map has them and one lies close enough on a matching surface.
+static bool irradianceEstimate(const PhotonMapBackend &map, const Vec3 &pos, const Vec3 &normal,
+                               int material, float u, float v, int textureId,
+                               float initialRadius, Vec3 &out)
+{
+    Vec3 irradiance;
+    if (!irradianceGather || !map.hasIrradiance() ||
+        !map.lookupIrradiance(pos, normal, initialRadius * initialRadius, irradiance))
+        return false;
+    out = irradiance * getMaterialColor(material, u, v, textureId) * (1.0f / PI);
+    return true;
+}
+
+// One k-NN gather through the lookup structure picked by the CPU-mode keys.
+static void gatherPhotons(const PhotonMapBackend &map, const Vec3 &pos, float &maxDistSq,
+                          PhotonHeap &heap)
+{
+    if (map.type() == PhotonBackendType::KdTree)
+    {
+        const PhotonMap &kdMap = static_cast<const PhotonMap &>(map);
+        if (bucketedGather)
+        {
+            kdMap.locatePhotonsBucketed(pos, gatherPhotonCount, maxDistSq, heap);
+            return;
+        }
+        if (vebGather)
+        {
+            kdMap.locatePhotonsVeb(pos, gatherPhotonCount, maxDistSq, heap);
+            return;
+        }
+    }
+    map.locatePhotons(pos, gatherPhotonCount, maxDistSq, heap);
+}
+
+// Cost mode only: repeats radianceEstimate's lookups on the heap-order trees
+// and adds the nodes they visit to the pixel, so the walks never count.
+static void tallyLookupNodes(const PhotonMapBackend &map, const Vec3 &pos, const Vec3 &normal,
+                             float initialRadius, bool irradianceHit)
+{
+    uint32_t &nodes = activePixelCost->photonNodes;
+    float maxDistSq = initialRadius * initialRadius;
+    if (irradianceGather && map.hasIrradiance())
+        nodes += map.irradianceLookupNodes(pos, normal, maxDistSq);
+    if (irradianceHit || map.type() != PhotonBackendType::KdTree)
+        return;
+
+    const PhotonMap &kdMap = static_cast<const PhotonMap &>(map);
+    if (rangeGather)
+        nodes += kdMap.rangeLookupNodes(pos, maxDistSq);
+    else
+        nodes += kdMap.lookupNodes(pos, gatherPhotonCount, maxDistSq);
+}
+
+Vec3 radianceEstimate(const PhotonMapBackend &map, const Vec3 &pos, const Vec3 &normal,
                       const Vec3 &wo, int material, float u, float v, int textureId,
                       float initialRadius)
 {
     if (map.size() == 0)
         return Vec3(0, 0, 0);
 
-    std::priority_queue<PhotonDistEntry> heap;
-    float maxDistSq = initialRadius * initialRadius;
+    Vec3 result;
+    bool irradianceHit =
+        irradianceEstimate(map, pos, normal, material, u, v, textureId, initialRadius, result);
+    if (activePixelCost)
+        tallyLookupNodes(map, pos, normal, initialRadius, irradianceHit);
+    if (irradianceHit)
+        return result;
 
-    map.locatePhotons(pos, MAX_GATHER_PHOTONS, maxDistSq, heap);
+    if (rangeGather && map.type() == PhotonBackendType::KdTree)
+        return rangeEstimate(static_cast<const PhotonMap &>(map), pos, normal, wo, material, u, v,
+                             textureId, initialRadius);
 
-    if (heap.empty())
-        return Vec3(0, 0, 0);
+    PhotonHeap heap;
+    float maxDistSq = initialRadius * initialRadius;
+    gatherPhotons(map, pos, maxDistSq, heap);
 
-    Vec3 result(0, 0, 0);
-    float alpha = getMaterialAlpha(material);
-    Vec3 albedo = getMaterialColor(material, u, v, textureId);
+    return shadeGatheredPhotons(heap, normal, wo, material, u, v, textureId);
+}
 
-    float finalRadiusSq = heap.top().distSq;
+void radianceEstimateBatch(const PhotonMapBackend &map, const GatherQuery *queries, int count,
+                           float initialRadius, Vec3 *out)
+{
+    if (map.size() == 0)
+    {
+        std::fill(out, out + count, Vec3(0, 0, 0));
+        return;
+    }
 
-    while (!heap.empty())
+    // Queries the irradiance photons cannot answer fall back to a full gather.
+    bool useRange = rangeGather && map.type() == PhotonBackendType::KdTree;
+    std::vector<int> pending;
+    std::vector<Vec3> positions;
+    for (int i = 0; i < count; i++)
     {
-        const Photon *p = heap.top().photon;
-        heap.pop();
+        const GatherQuery &q = queries[i];
+        if (irradianceEstimate(map, q.position, q.normal, q.material, q.u, q.v, q.textureId,
+                               initialRadius, out[i]))
+            continue;
 
-        float nDotWi = normal.dot(p->incomingDir);
-        if (nDotWi <= 0)
+        if (useRange)
+        {
+            out[i] = rangeEstimate(static_cast<const PhotonMap &>(map), q.position, q.normal, q.wo,
+                                   q.material, q.u, q.v, q.textureId, initialRadius);
             continue;
+        }
+        pending.push_back(i);
+        positions.push_back(q.position);
+    }
+    int pendingCount = (int)pending.size();
 
-        float brdf = schlickBRDF(normal, wo, p->incomingDir, alpha);
-        result += p->power * brdf;
+    std::vector<PhotonHeap> heaps(pendingCount);
+    float initialMaxDistSq = initialRadius * initialRadius;
+    if ((bucketedGather || vebGather) && map.type() == PhotonBackendType::KdTree)
+    {
+        for (int i = 0; i < pendingCount; i++)
+        {
+            float maxDistSq = initialMaxDistSq;
+            gatherPhotons(map, positions[i], maxDistSq, heaps[i]);
+        }
+    }
+    else
+    {
+        map.locatePhotonsBatch(positions.data(), pendingCount, gatherPhotonCount,
+                               initialMaxDistSq, heaps.data());
     }
 
-    float area = PI * finalRadiusSq;
-    if (area > 0)
+    for (int i = 0; i < pendingCount; i++)
     {
-        result = result * (1.0f / area);
+        const GatherQuery &q = queries[pending[i]];
+        out[pending[i]] = shadeGatheredPhotons(heaps[i], q.normal, q.wo, q.material, q.u, q.v,
+                                               q.textureId);
     }
+}
 
-    return result * albedo;
+namespace
+{
+const float LIGHT_CENTER_X = 278.0f;
+const float LIGHT_CENTER_Z = 279.5f;
+const float LIGHT_HALF_W = 65.0f;
+const float LIGHT_HALF_D = 52.5f;
+// Light power split over the global photons.
+const float LIGHT_PHOTON_POWER = 1000000.0f;
+// Light power split over the caustic photons, before the projection map's
+// weight. Chosen so the glass sphere's caustic keeps the exposure it had when
+// 2.5M was aimed at a box around that sphere alone.
+const float CAUSTIC_LIGHT_POWER = 90000000.0f;
+
+// Stream ids: caustic photon i uses stream i, global photon i stream
+// GLOBAL_STREAM + i, so neither map depends on the other's photon count.
+// Importon i uses IMPORTON_STREAM + i.
+const uint64_t GLOBAL_STREAM = uint64_t(1) << 32;
+const uint64_t IMPORTON_STREAM = uint64_t(2) << 32;
+// Diffuse bounces an importon makes past the surface the camera sees.
+const int IMPORTON_DIFFUSE_BOUNCES = 3;
 }
 
-void tracePhotons(PhotonMap &causticMap, PhotonMap &globalMap, std::mt19937 &rng)
+static bool emitCausticPhoton(int index, PhotonSampler &sampler, const PhotonProjectionMap &projection,
+                              Vec3 &ro, Vec3 &rd, Vec3 &power)
 {
-    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    float weight;
+    if (!projection.sample(index, sampler, ro, rd, weight))
+        return false;
+    power = Vec3(weight, weight, weight);
+    return true;
+}
 
-    float lightCenterX = 278.0f;
-    float lightCenterZ = 279.5f;
-    float lightHalfW = 65.0f;
-    float lightHalfD = 52.5f;
+static bool emitGlobalPhoton(PhotonSampler &sampler, Vec3 &ro, Vec3 &rd, Vec3 &power)
+{
+    float lightU = sampler.get(0);
+    float lightV = sampler.get(1);
+    ro = Vec3(
+        LIGHT_CENTER_X + (lightU - 0.5f) * 2.0f * LIGHT_HALF_W,
+        548.7f,
+        LIGHT_CENTER_Z + (lightV - 0.5f) * 2.0f * LIGHT_HALF_D);
 
-    Vec3 causticPhotonPower = Vec3(1.0f, 1.0f, 1.0f) * (2500000.0f / CAUSTIC_PHOTON_COUNT);
-    Vec3 globalPhotonPower = Vec3(1.0f, 1.0f, 1.0f) * (1000000.0f / GLOBAL_PHOTON_COUNT);
+    float r1 = sampler.get(2);
+    float r2 = sampler.get(3);
+    rd = cosineWeightedHemisphere(Vec3(0, -1, 0), r1, r2);
+    power = Vec3(1, 1, 1);
+    return true;
+}
 
-    std::cout << "Tracing caustic photons..." << std::endl;
+static bool emitImportantGlobalPhoton(PhotonSampler &sampler, const PhotonImportanceMap &importance,
+                                      Vec3 &ro, Vec3 &rd, Vec3 &power)
+{
+    float weight;
+    importance.sample(sampler, ro, rd, weight);
+    power = Vec3(weight, weight, weight);
+    return true;
+}
 
-    for (int i = 0; i < CAUSTIC_PHOTON_COUNT; i++)
+// Importons start on random camera rays and follow them like trace() to a
+// diffuse surface, then bounce diffusely from there. A global photon stored
+// at a visible surface came from one of those later vertices, so each of
+// them is joined to a random light point and the light direction towards it
+// gets the vertex's importance: the path's albedo times the geometry term.
+static void traceImportons(const CPUCamera &cam, int count, uint32_t seed,
+                           PhotonImportanceMap &importance)
+{
+    struct Deposit
     {
-        Vec3 ro(
-            lightCenterX + (dist(rng) - 0.5f) * 2.0f * lightHalfW,
-            548.7f,
-            lightCenterZ + (dist(rng) - 0.5f) * 2.0f * lightHalfD);
+        Vec3 origin, direction;
+        float importance;
+    };
 
-        Vec3 target = Vec3(185, 80, 169) + Vec3(
-                                               (dist(rng) - 0.5f) * 160.0f,
-                                               (dist(rng) - 0.5f) * 160.0f,
-                                               (dist(rng) - 0.5f) * 160.0f);
-        Vec3 rd = (target - ro).normalize();
+    float aspectRatio = static_cast<float>(WIDTH) / static_cast<float>(HEIGHT);
+    float scale = std::tan(40.0f * 0.5f * PI / 180.0f);
+    Vec3 forward = cam.getForward();
+    Vec3 right = cam.getRight();
+    Vec3 up = cam.getUp();
 
-        Vec3 power = causticPhotonPower;
-        bool hitSpecular = false;
+    int blockCount = (count + PHOTON_TRACE_BLOCK - 1) / PHOTON_TRACE_BLOCK;
+    std::vector<std::vector<Deposit>> blocks(blockCount);
 
-        for (int bounce = 0; bounce < 20; bounce++)
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < blockCount; b++)
+    {
+        if (cancelPhotonTracing)
+            continue;
+        int last = std::min(count, (b + 1) * PHOTON_TRACE_BLOCK);
+        for (int i = b * PHOTON_TRACE_BLOCK; i < last; i++)
         {
-            Hit hit;
-            if (!intersectScene(ro, rd, hit, false))
-                break;
+            CounterRng rng(seed, IMPORTON_STREAM + i);
+            std::uniform_real_distribution<float> dist(0.0f, 1.0f);
 
-            if (hit.material == 1 || hit.material == 2)
+            float px = (dist(rng) * 2.0f - 1.0f) * aspectRatio * scale;
+            float py = (dist(rng) * 2.0f - 1.0f) * scale;
+            Vec3 ro = cam.position;
+            Vec3 rd = (right * px + up * py + forward).normalize();
+            float throughput = 1.0f;
+            int diffuseVertices = 0;
+
+            for (int bounce = 0; bounce < 10; bounce++)
             {
-                hitSpecular = true;
+                Hit hit;
+                if (!intersectScene(ro, rd, hit, false))
+                    break;
 
                 if (hit.material == 2)
                 {
                     rd = reflectVec(rd, hit.normal);
                     ro = hit.point + hit.normal * 0.001f;
-                    power = power * 0.95f;
+                    continue;
                 }
-                else
+
+                if (hit.material == 1)
                 {
                     float ior = 1.5f;
                     bool entering = rd.dot(hit.normal) < 0;
                     Vec3 n = entering ? hit.normal : -hit.normal;
                     float eta = entering ? (1.0f / ior) : ior;
-
-                    float cosTheta = (-rd).dot(n);
-                    float Fr = fresnelDielectric(cosTheta, 1.0f, ior);
-
-                    if (dist(rng) < Fr)
+                    Vec3 refracted = refractVec(rd, n, eta);
+                    if (dist(rng) < fresnelDielectric((-rd).dot(n), 1.0f, ior) ||
+                        refracted.lengthSq() < 0.001f)
                     {
                         rd = reflectVec(rd, n);
                         ro = hit.point + n * 0.001f;
                     }
                     else
                     {
-                        Vec3 refracted = refractVec(rd, n, eta);
-                        if (refracted.lengthSq() < 0.001f)
-                        {
-                            rd = reflectVec(rd, n);
-                            ro = hit.point + n * 0.001f;
-                        }
-                        else
-                        {
-                            rd = refracted.normalize();
-                            ro = hit.point - n * 0.001f;
-                        }
+                        rd = refracted.normalize();
+                        ro = hit.point - n * 0.001f;
                     }
-                    power = power * 0.99f;
+                    continue;
                 }
-                continue;
-            }
 
-            if ((hit.material == 0 || hit.material == 3 || hit.material == 4) && hitSpecular)
-            {
-                causticMap.store(hit.point, power * getMaterialColor(hit.material, hit.u, hit.v, hit.textureId), (-rd).normalize());
-                break;
-            }
+                if (hit.material != 0 && hit.material != 3 && hit.material != 4)
+                    break;
 
-            break;
+                if (diffuseVertices > 0)
+                {
+                    Vec3 color = getMaterialColor(hit.material, hit.u, hit.v, hit.textureId);
+                    throughput *= (color.x + color.y + color.z) / 3.0f;
+
+                    Vec3 lightPoint(LIGHT_CENTER_X + (dist(rng) - 0.5f) * 2.0f * LIGHT_HALF_W, 548.7f,
+                                    LIGHT_CENTER_Z + (dist(rng) - 0.5f) * 2.0f * LIGHT_HALF_D);
+                    Vec3 toLight = lightPoint - hit.point;
+                    float distToLight = toLight.length();
+                    Vec3 L = toLight.normalize();
+                    float cosSurface = hit.normal.dot(L);
+                    float cosLight = L.y;
+
+                    Hit shadowHit;
+                    bool blocked = intersectScene(hit.point + hit.normal * 0.001f, L, shadowHit, true) &&
+                                   shadowHit.t < distToLight - 0.01f && shadowHit.material != 5;
+                    if (cosSurface > 0.0f && cosLight > 0.0f && !blocked)
+                    {
+                        // Clamped so that corners next to the light do not dominate.
+                        float distSq = std::max(distToLight * distToLight, 100.0f);
+                        blocks[b].push_back({lightPoint, -L, throughput * cosSurface * cosLight / distSq});
+                    }
+                }
+
+                if (++diffuseVertices > IMPORTON_DIFFUSE_BOUNCES)
+                    break;
+                float r1 = dist(rng);
+                float r2 = dist(rng);
+                rd = cosineWeightedHemisphere(hit.normal, r1, r2);
+                ro = hit.point + hit.normal * 0.001f;
+            }
         }
     }
 
-    std::cout << "Stored " << causticMap.size() << " caustic photons" << std::endl;
-    std::cout << "Tracing global photons..." << std::endl;
-
-    for (int i = 0; i < GLOBAL_PHOTON_COUNT; i++)
+    for (const std::vector<Deposit> &block : blocks)
     {
-        Vec3 ro(
-            lightCenterX + (dist(rng) - 0.5f) * 2.0f * lightHalfW,
-            548.7f,
-            lightCenterZ + (dist(rng) - 0.5f) * 2.0f * lightHalfD);
+        for (const Deposit &d : block)
+            importance.deposit(d.origin, d.direction, d.importance);
+    }
+    importance.finalize();
+}
 
-        Vec3 rd = cosineWeightedHemisphere(Vec3(0, -1, 0), rng);
+// Scalar reference for tracePhotonStream's caustic paths.
+static void traceCausticPath(int index, PhotonSampler &sampler, Vec3 ro, Vec3 rd, Vec3 power,
+                             std::vector<TracedPhoton> &out)
+{
+    bool hitSpecular = false;
 
-        Vec3 power = globalPhotonPower;
-        bool storedFirst = false;
+    for (int bounce = 0; bounce < 20; bounce++)
+    {
+        Hit hit;
+        if (!intersectScene(ro, rd, hit, false))
+            break;
 
-        for (int bounce = 0; bounce < 10; bounce++)
+        if (hit.material == 1 || hit.material == 2)
         {
-            Hit hit;
-            if (!intersectScene(ro, rd, hit, false))
-                break;
-
-            if (hit.material == 0 || hit.material == 3 || hit.material == 4)
-            {
-                if (storedFirst)
-                {
-                    globalMap.store(hit.point, power * getMaterialColor(hit.material, hit.u, hit.v, hit.textureId), (-rd).normalize());
-                }
-                storedFirst = true;
-
-                float survivalProb = std::max(getMaterialColor(hit.material).x,
-                                              std::max(getMaterialColor(hit.material).y,
-                                                       getMaterialColor(hit.material).z));
-                if (dist(rng) > survivalProb)
-                    break;
-                power = power * (1.0f / survivalProb);
-
-                rd = cosineWeightedHemisphere(hit.normal, rng);
-                ro = hit.point + hit.normal * 0.001f;
-                power = power * getMaterialColor(hit.material, hit.u, hit.v, hit.textureId);
-                continue;
-            }
+            hitSpecular = true;
 
             if (hit.material == 2)
             {
                 rd = reflectVec(rd, hit.normal);
                 ro = hit.point + hit.normal * 0.001f;
                 power = power * 0.95f;
-                continue;
             }
-
-            if (hit.material == 1)
+            else
             {
                 float ior = 1.5f;
                 bool entering = rd.dot(hit.normal) < 0;
@@ -296,7 +517,7 @@ void tracePhotons(PhotonMap &causticMap, PhotonMap &globalMap, std::mt19937 &rng
                 float cosTheta = (-rd).dot(n);
                 float Fr = fresnelDielectric(cosTheta, 1.0f, ior);
 
-                if (dist(rng) < Fr)
+                if (sampler.get(photonBounceDimension(bounce, 0)) < Fr)
                 {
                     rd = reflectVec(rd, n);
                     ro = hit.point + n * 0.001f;
@@ -316,27 +537,323 @@ void tracePhotons(PhotonMap &causticMap, PhotonMap &globalMap, std::mt19937 &rng
                     }
                 }
                 power = power * 0.99f;
+            }
+            continue;
+        }
+
+        if ((hit.material == 0 || hit.material == 3 || hit.material == 4) && hitSpecular)
+        {
+            out.push_back({hit.point, power * getMaterialColor(hit.material, hit.u, hit.v, hit.textureId),
+                           (-rd).normalize(), hit.normal, hit.primitive, index});
+            break;
+        }
+
+        break;
+    }
+}
+
+// Scalar reference for tracePhotonStream's global paths.
+static void traceGlobalPath(int index, PhotonSampler &sampler, Vec3 ro, Vec3 rd, Vec3 power,
+                            std::vector<TracedPhoton> &out)
+{
+    bool storedFirst = false;
+
+    for (int bounce = 0; bounce < 10; bounce++)
+    {
+        Hit hit;
+        if (!intersectScene(ro, rd, hit, false))
+            break;
+
+        if (hit.material == 0 || hit.material == 3 || hit.material == 4)
+        {
+            if (storedFirst)
+            {
+                out.push_back({hit.point, power * getMaterialColor(hit.material, hit.u, hit.v, hit.textureId),
+                               (-rd).normalize(), hit.normal, hit.primitive, index});
+            }
+            storedFirst = true;
+
+            float survivalProb = std::max(getMaterialColor(hit.material).x,
+                                          std::max(getMaterialColor(hit.material).y,
+                                                   getMaterialColor(hit.material).z));
+            if (sampler.get(photonBounceDimension(bounce, 0)) > survivalProb)
+                break;
+            power = power * (1.0f / survivalProb);
+
+            float r1 = sampler.get(photonBounceDimension(bounce, 1));
+            float r2 = sampler.get(photonBounceDimension(bounce, 2));
+            rd = cosineWeightedHemisphere(hit.normal, r1, r2);
+            ro = hit.point + hit.normal * 0.001f;
+            power = power * getMaterialColor(hit.material, hit.u, hit.v, hit.textureId);
+            continue;
+        }
+
+        if (hit.material == 2)
+        {
+            rd = reflectVec(rd, hit.normal);
+            ro = hit.point + hit.normal * 0.001f;
+            power = power * 0.95f;
+            continue;
+        }
+
+        if (hit.material == 1)
+        {
+            float ior = 1.5f;
+            bool entering = rd.dot(hit.normal) < 0;
+            Vec3 n = entering ? hit.normal : -hit.normal;
+            float eta = entering ? (1.0f / ior) : ior;
+
+            float cosTheta = (-rd).dot(n);
+            float Fr = fresnelDielectric(cosTheta, 1.0f, ior);
+
+            if (sampler.get(photonBounceDimension(bounce, 0)) < Fr)
+            {
+                rd = reflectVec(rd, n);
+                ro = hit.point + n * 0.001f;
+            }
+            else
+            {
+                Vec3 refracted = refractVec(rd, n, eta);
+                if (refracted.lengthSq() < 0.001f)
+                {
+                    rd = reflectVec(rd, n);
+                    ro = hit.point + n * 0.001f;
+                }
+                else
+                {
+                    rd = refracted.normalize();
+                    ro = hit.point - n * 0.001f;
+                }
+            }
+            power = power * 0.99f;
+            continue;
+        }
+    }
+}
+
+// Traces photons in parallel, PHOTON_TRACE_BLOCK per task, and stores each
+// round's blocks in index order, so the map receives the same photons in the
+// same order for any thread count. With storeTarget zero exactly emitCount
+// photons are emitted and stored a round at a time. Otherwise each round is
+// stored at unit scale as it completes, up to the path that reaches
+// storeTarget stored photons, and map.scalePower() splits totalPower over the
+// emitted count once that is known. Returns the number of photons emitted. traceBlock(first, last, out) appends the photons
+// of emissions [first, last) to `out` in emission order.
+template <typename TraceBlockFn>
+static int traceIntoMap(PhotonMapBackend &map, float totalPower, int emitCount, int storeTarget,
+                        TraceBlockFn traceBlock)
+{
+    const int blocksPerRound = 64;
+    // Slack on the stores per emission the first round measured.
+    const double reserveHeadroom = 1.1;
+    std::vector<std::vector<TracedPhoton>> blocks(blocksPerRound);
+    bool untilStored = storeTarget > 0;
+    int limit = untilStored
+                    ? (int)std::min<long long>(INT_MAX, (long long)storeTarget * PHOTON_EMIT_LIMIT_FACTOR)
+                    : emitCount;
+    int emitted = limit;
+    size_t stored = 0;
+    // Emission whose path took `stored` to storeTarget; -1 until then.
+    int lastEmission = -1;
+    if (untilStored)
+        map.reserve(storeTarget);
+
+    for (int roundStart = 0; roundStart < limit; roundStart += blocksPerRound * PHOTON_TRACE_BLOCK)
+    {
+        int roundEnd = (int)std::min<long long>(limit, (long long)roundStart + blocksPerRound * PHOTON_TRACE_BLOCK);
+        int blockCount = (roundEnd - roundStart + PHOTON_TRACE_BLOCK - 1) / PHOTON_TRACE_BLOCK;
+
+#pragma omp parallel for schedule(dynamic)
+        for (int b = 0; b < blockCount; b++)
+        {
+            blocks[b].clear();
+            if (cancelPhotonTracing)
                 continue;
+            int first = roundStart + b * PHOTON_TRACE_BLOCK;
+            int last = std::min(roundEnd, first + PHOTON_TRACE_BLOCK);
+            traceBlock(first, last, blocks[b]);
+        }
+        if (cancelPhotonTracing)
+            break;
+
+        if (!untilStored)
+        {
+            // Global paths store at several diffuse hits each, so the shared
+            // store array is sized from the first round's stores per emission.
+            if (roundStart == 0)
+            {
+                size_t roundStored = 0;
+                for (int b = 0; b < blockCount; b++)
+                    roundStored += blocks[b].size();
+                map.reserve((size_t)((double)roundStored / (roundEnd - roundStart) * limit * reserveHeadroom));
             }
+            float scale = totalPower / emitCount;
+            for (int b = 0; b < blockCount; b++)
+            {
+                for (const TracedPhoton &p : blocks[b])
+                    map.store(p.position, p.power * scale, p.incomingDir, p.normal, p.primitive);
+            }
+            continue;
         }
+
+        // A path's photons never span blocks, so the round holds all of them.
+        bool pathDone = false;
+        for (int b = 0; b < blockCount && !pathDone; b++)
+        {
+            for (const TracedPhoton &p : blocks[b])
+            {
+                pathDone = lastEmission >= 0 && p.emission != lastEmission;
+                if (pathDone)
+                    break;
+                map.store(p.position, p.power, p.incomingDir, p.normal, p.primitive);
+                stored++;
+                if (lastEmission < 0 && (int)stored >= storeTarget)
+                    lastEmission = p.emission;
+            }
+        }
+        if (lastEmission >= 0)
+        {
+            emitted = lastEmission + 1;
+            break;
+        }
+    }
+
+    map.flushStores();
+    if (untilStored)
+    {
+        if (lastEmission < 0 && !cancelPhotonTracing)
+            std::cout << "Stopped after " << limit << " emitted photons with only " << stored
+                      << " of " << storeTarget << " stored" << std::endl;
+        map.scalePower(totalPower / emitted);
+    }
+    return emitted;
+}
+
+void tracePhotons(PhotonMapBackend &causticMap, PhotonMapBackend &globalMap, uint32_t seed,
+                  const PhotonBudget &budget, const CPUCamera *importanceCamera)
+{
+    std::cout << "Tracing caustic photons..." << std::endl;
+
+    // Caustic photons are only emitted towards the specular spheres.
+    static const PhotonProjectionMap projection(Vec3(LIGHT_CENTER_X, 548.7f, LIGHT_CENTER_Z),
+                                                LIGHT_HALF_W, LIGHT_HALF_D);
+    PhotonEmitFn emitCaustic = [&](int i, PhotonSampler &sampler, Vec3 &ro, Vec3 &rd, Vec3 &power)
+    {
+        return emitCausticPhoton(i, sampler, projection, ro, rd, power);
+    };
+    PhotonEmitFn emitGlobal = [](int, PhotonSampler &sampler, Vec3 &ro, Vec3 &rd, Vec3 &power)
+    {
+        return emitGlobalPhoton(sampler, ro, rd, power);
+    };
+
+    // Global photons are emitted where the camera's importons say they matter.
+    PhotonImportanceMap importance(Vec3(LIGHT_CENTER_X, 548.7f, LIGHT_CENTER_Z), LIGHT_HALF_W,
+                                   LIGHT_HALF_D);
+    if (importanceCamera)
+    {
+        auto importonStart = std::chrono::steady_clock::now();
+        traceImportons(*importanceCamera, IMPORTON_COUNT, seed, importance);
+        double importonMs = std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - importonStart)
+                                .count();
+        if (cancelPhotonTracing)
+            return;
+        std::cout << "Traced " << IMPORTON_COUNT << " importons in " << importonMs << " ms; "
+                  << importance.binsHolding(0.9f) << " of " << importance.binCount()
+                  << " emission bins hold 90% of the importance" << std::endl;
+
+        emitGlobal = [&](int, PhotonSampler &sampler, Vec3 &ro, Vec3 &rd, Vec3 &power)
+        {
+            return emitImportantGlobalPhoton(sampler, importance, ro, rd, power);
+        };
     }
+    const SampleSequence *sequence = sampleSequence(samplerType);
 
-    std::cout << "Stored " << globalMap.size() << " global photons" << std::endl;
+    // Emissions [first, last) of one map, on the stream tracer or one path at a time.
+    auto blockTracer = [&](PhotonPathRule rule, const PhotonEmitFn &emit, uint64_t firstStream)
+    {
+        return [&, rule, firstStream](int first, int last, std::vector<TracedPhoton> &out)
+        {
+            if (streamPhotonTracing)
+            {
+                tracePhotonStream(rule, first, last, seed, firstStream, sequence, emit, out);
+                return;
+            }
+            for (int i = first; i < last; i++)
+            {
+                PhotonSampler sampler = photonSampler(sequence, seed, firstStream, i);
+                Vec3 ro, rd, power;
+                if (!emit(i, sampler, ro, rd, power))
+                    continue;
+                if (rule == PhotonPathRule::Caustic)
+                    traceCausticPath(i, sampler, ro, rd, power, out);
+                else
+                    traceGlobalPath(i, sampler, ro, rd, power, out);
+            }
+        };
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    int causticEmitted = traceIntoMap(causticMap, CAUSTIC_LIGHT_POWER, budget.causticEmitted,
+                                      budget.causticStored,
+                                      blockTracer(PhotonPathRule::Caustic, emitCaustic, 0));
+    auto end = std::chrono::steady_clock::now();
+    if (cancelPhotonTracing)
+        return;
+
+    std::cout << "Stored " << causticMap.size() << " caustic photons of " << causticEmitted
+              << " emitted in " << std::chrono::duration<double, std::milli>(end - start).count()
+              << " ms" << std::endl;
+    std::cout << "Tracing global photons..." << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    int globalEmitted = traceIntoMap(globalMap, LIGHT_PHOTON_POWER, budget.globalEmitted,
+                                     budget.globalStored,
+                                     blockTracer(PhotonPathRule::Global, emitGlobal, GLOBAL_STREAM));
+    end = std::chrono::steady_clock::now();
+    if (cancelPhotonTracing)
+        return;
+
+    std::cout << "Stored " << globalMap.size() << " global photons of " << globalEmitted
+              << " emitted in " << std::chrono::duration<double, std::milli>(end - start).count()
+              << " ms" << std::endl;
 }
 
-Vec3 directLighting(const Vec3 &pos, const Vec3 &normal, std::mt19937 &rng)
+PixelSampler pixelSampler(int x, int y, int frameIndex)
 {
-    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+    // The frame's pixels share the first 2^bits points, shuffled by a
+    // bijection so that neighbouring pixels get unrelated ones; in scanline
+    // order the sequence's structure shows up as stripes.
+    int bits = 1;
+    while ((1u << bits) < (uint32_t)(WIDTH * HEIGHT))
+        bits++;
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t key = (uint32_t)scrambleKey(1, frameIndex);
+    uint32_t point = (uint32_t)(y * WIDTH + x);
+    for (int round = 0; round < 3; round++)
+    {
+        point = (point ^ key) & mask;
+        point = (point * 0x9E3779B1u) & mask;
+        point ^= point >> (bits / 2);
+    }
 
+    return PixelSampler(std::mt19937(y * WIDTH + x + frameIndex * WIDTH * HEIGHT),
+                        sampleSequence(samplerType), point, scrambleKey(0, frameIndex));
+}
+
+Vec3 directLighting(const Vec3 &pos, const Vec3 &normal, PixelSampler &sampler, int depth)
+{
     float lightCenterX = 278.0f;
     float lightCenterZ = 279.5f;
     float lightHalfW = 65.0f;
     float lightHalfD = 52.5f;
 
+    float lightU = sampler.get(pixelDimension(depth, 1));
+    float lightV = sampler.get(pixelDimension(depth, 2));
     Vec3 lightPos(
-        lightCenterX + (dist(rng) - 0.5f) * 2.0f * lightHalfW,
+        lightCenterX + (lightU - 0.5f) * 2.0f * lightHalfW,
         548.7f,
-        lightCenterZ + (dist(rng) - 0.5f) * 2.0f * lightHalfD);
+        lightCenterZ + (lightV - 0.5f) * 2.0f * lightHalfD);
 
     Vec3 toLight = lightPos - pos;
     float distToLight = toLight.length();
@@ -365,13 +882,14 @@ Vec3 directLighting(const Vec3 &pos, const Vec3 &normal, std::mt19937 &rng)
     return Le * G * lightArea / PI;
 }
 
-Vec3 trace(Vec3 ro, Vec3 rd, const PhotonMap &causticMap, const PhotonMap &globalMap,
-           std::mt19937 &rng, int depth)
+Vec3 trace(Vec3 ro, Vec3 rd, const PhotonMapBackend &causticMap, const PhotonMapBackend &globalMap,
+           PixelSampler &sampler, int depth)
 {
+    if (activePixelCost)
+        activePixelCost->maxDepth = std::max(activePixelCost->maxDepth, (uint32_t)depth);
     if (depth > 10)
         return Vec3(0, 0, 0);
 
-    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
     Hit hit;
 
     if (!intersectScene(ro, rd, hit))
@@ -389,11 +907,11 @@ Vec3 trace(Vec3 ro, Vec3 rd, const PhotonMap &causticMap, const PhotonMap &globa
     {
         Vec3 wo = (-rd).normalize();
 
-        Vec3 direct = directLighting(hit.point, hit.normal, rng) *
+        Vec3 direct = directLighting(hit.point, hit.normal, sampler, depth) *
                       getMaterialColor(hit.material, hit.u, hit.v, hit.textureId) / PI;
 
         Vec3 caustic = radianceEstimate(causticMap, hit.point, hit.normal, wo,
-                                        hit.material, hit.u, hit.v, hit.textureId, 30.0f);
+                                        hit.material, hit.u, hit.v, hit.textureId, CAUSTIC_RADIUS);
 
         Vec3 indirect = radianceEstimate(globalMap, hit.point, hit.normal, wo,
                                          hit.material, hit.u, hit.v, hit.textureId, INITIAL_RADIUS);
@@ -405,7 +923,7 @@ Vec3 trace(Vec3 ro, Vec3 rd, const PhotonMap &causticMap, const PhotonMap &globa
     {
         Vec3 reflectDir = reflectVec(rd, hit.normal);
         return trace(hit.point + hit.normal * 0.001f, reflectDir,
-                     causticMap, globalMap, rng, depth + 1) *
+                     causticMap, globalMap, sampler, depth + 1) *
                0.98f;
     }
 
@@ -421,11 +939,11 @@ Vec3 trace(Vec3 ro, Vec3 rd, const PhotonMap &causticMap, const PhotonMap &globa
 
         Vec3 result(0, 0, 0);
 
-        if (dist(rng) < Fr)
+        if (sampler.get(pixelDimension(depth, 0)) < Fr)
         {
             Vec3 reflectDir = reflectVec(rd, n);
             result = trace(hit.point + n * 0.001f, reflectDir,
-                           causticMap, globalMap, rng, depth + 1);
+                           causticMap, globalMap, sampler, depth + 1);
         }
         else
         {
@@ -434,12 +952,12 @@ Vec3 trace(Vec3 ro, Vec3 rd, const PhotonMap &causticMap, const PhotonMap &globa
             {
                 Vec3 reflectDir = reflectVec(rd, n);
                 result = trace(hit.point + n * 0.001f, reflectDir,
-                               causticMap, globalMap, rng, depth + 1);
+                               causticMap, globalMap, sampler, depth + 1);
             }
             else
             {
                 result = trace(hit.point - n * 0.001f, refracted.normalize(),
-                               causticMap, globalMap, rng, depth + 1);
+                               causticMap, globalMap, sampler, depth + 1);
             }
         }
 
@@ -449,9 +967,147 @@ Vec3 trace(Vec3 ro, Vec3 rd, const PhotonMap &causticMap, const PhotonMap &globa
     return Vec3(0, 0, 0);
 }
 
+// Follows a camera ray through specular bounces exactly like trace(), but stops
+// at the first diffuse hit instead of gathering there. Returns true with
+// `query` filled in for such a hit; `radiance` holds everything except the
+// photon-map terms, which are to be added scaled by `throughput`.
+static bool traceToDiffuse(Vec3 ro, Vec3 rd, PixelSampler &sampler, Vec3 &throughput,
+                           Vec3 &radiance, GatherQuery &query)
+{
+    throughput = Vec3(1, 1, 1);
+    radiance = Vec3(0, 0, 0);
+
+    for (int depth = 0; depth <= 10; depth++)
+    {
+        Hit hit;
+        if (!intersectScene(ro, rd, hit))
+        {
+            radiance = throughput * Vec3(0.01f, 0.01f, 0.02f);
+            return false;
+        }
+
+        if (hit.material == 5)
+        {
+            radiance = throughput * getMaterialColor(5);
+            return false;
+        }
+
+        if (hit.material == 0 || hit.material == 3 || hit.material == 4)
+        {
+            Vec3 direct = directLighting(hit.point, hit.normal, sampler, depth) *
+                          getMaterialColor(hit.material, hit.u, hit.v, hit.textureId) / PI;
+            radiance = throughput * direct;
+
+            query.position = hit.point;
+            query.normal = hit.normal;
+            query.wo = (-rd).normalize();
+            query.material = hit.material;
+            query.u = hit.u;
+            query.v = hit.v;
+            query.textureId = hit.textureId;
+            return true;
+        }
+
+        if (hit.material == 2)
+        {
+            ro = hit.point + hit.normal * 0.001f;
+            rd = reflectVec(rd, hit.normal);
+            throughput = throughput * 0.98f;
+            continue;
+        }
+
+        if (hit.material == 1)
+        {
+            float ior = 1.5f;
+            bool entering = rd.dot(hit.normal) < 0;
+            Vec3 n = entering ? hit.normal : -hit.normal;
+            float eta = entering ? (1.0f / ior) : ior;
+
+            float cosTheta = (-rd).dot(n);
+            float Fr = fresnelDielectric(cosTheta, 1.0f, ior);
+
+            if (sampler.get(pixelDimension(depth, 0)) < Fr)
+            {
+                ro = hit.point + n * 0.001f;
+                rd = reflectVec(rd, n);
+            }
+            else
+            {
+                Vec3 refracted = refractVec(rd, n, eta);
+                if (refracted.lengthSq() < 0.001f)
+                {
+                    ro = hit.point + n * 0.001f;
+                    rd = reflectVec(rd, n);
+                }
+                else
+                {
+                    ro = hit.point - n * 0.001f;
+                    rd = refracted.normalize();
+                }
+            }
+            throughput = throughput * 0.99f;
+            continue;
+        }
+
+        return false;
+    }
+    return false;
+}
+
+void renderTile(const CPUCamera &cam, const PhotonMapBackend &causticMap,
+                const PhotonMapBackend &globalMap, int x0, int y0, int x1, int y1,
+                int frameIndex, Vec3 *out)
+{
+    float aspectRatio = static_cast<float>(WIDTH) / static_cast<float>(HEIGHT);
+    float scale = std::tan(40.0f * 0.5f * PI / 180.0f);
+    Vec3 forward = cam.getForward();
+    Vec3 right = cam.getRight();
+    Vec3 up = cam.getUp();
+
+    int tileWidth = x1 - x0;
+    int pixelCount = tileWidth * (y1 - y0);
+
+    std::vector<GatherQuery> queries;
+    std::vector<int> queryPixel;
+    std::vector<Vec3> throughput;
+    queries.reserve(pixelCount);
+    queryPixel.reserve(pixelCount);
+    throughput.reserve(pixelCount);
+
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            PixelSampler sampler = pixelSampler(x, y, frameIndex);
+
+            float px = ((static_cast<float>(x) + 0.5f) / WIDTH * 2.0f - 1.0f) * aspectRatio * scale;
+            float py = ((static_cast<float>(y) + 0.5f) / HEIGHT * 2.0f - 1.0f) * scale;
+            Vec3 rd = (right * px + up * py + forward).normalize();
+
+            int pixel = (y - y0) * tileWidth + (x - x0);
+            GatherQuery query;
+            Vec3 weight;
+            if (traceToDiffuse(cam.position, rd, sampler, weight, out[pixel], query))
+            {
+                queries.push_back(query);
+                queryPixel.push_back(pixel);
+                throughput.push_back(weight);
+            }
+        }
+    }
+
+    int count = (int)queries.size();
+    std::vector<Vec3> caustic(count), indirect(count);
+    radianceEstimateBatch(causticMap, queries.data(), count, CAUSTIC_RADIUS, caustic.data());
+    radianceEstimateBatch(globalMap, queries.data(), count, INITIAL_RADIUS, indirect.data());
+
+    for (int i = 0; i < count; i++)
+        out[queryPixel[i]] += throughput[i] * (caustic[i] + indirect[i]);
+}
+
 Vec3 renderPixel(float px, float py, const CPUCamera &cam,
-                 const PhotonMap &causticMap, const PhotonMap &globalMap,
-                 std::mt19937 &rng)
+                 const PhotonMapBackend &causticMap, const PhotonMapBackend &globalMap,
+                 PixelSampler &sampler)
 {
     float fov = 40.0f;
     float scale = std::tan(fov * 0.5f * PI / 180.0f);
@@ -462,7 +1118,51 @@ Vec3 renderPixel(float px, float py, const CPUCamera &cam,
 
     Vec3 rd = (right * px + up * py + forward).normalize();
 
-    return trace(cam.position, rd, causticMap, globalMap, rng);
+    return trace(cam.position, rd, causticMap, globalMap, sampler);
+}
+
+std::vector<Vec3> sampleGatherPoints(const CPUCamera &cam, int count, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    float scale = std::tan(40.0f * 0.5f * PI / 180.0f);
+
+    std::vector<Vec3> points;
+    points.reserve(count);
+    for (int attempt = 0; attempt < 4 * count && (int)points.size() < count; attempt++)
+    {
+        Vec3 rd = (cam.getRight() * (dist(rng) * scale) + cam.getUp() * (dist(rng) * scale) +
+                   cam.getForward())
+                      .normalize();
+        Hit hit;
+        if (intersectScene(cam.position, rd, hit) &&
+            (hit.material == 0 || hit.material == 3 || hit.material == 4))
+        {
+            points.push_back(hit.point);
+        }
+    }
+    return points;
+}
+
+double timePhotonLookups(const PhotonMapBackend &map, const std::vector<Vec3> &points,
+                         float initialRadius)
+{
+    if (points.empty())
+        return 0.0;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t found = 0;
+    for (const Vec3 &p : points)
+    {
+        PhotonHeap heap;
+        float maxDistSq = initialRadius * initialRadius;
+        map.locatePhotons(p, gatherPhotonCount, maxDistSq, heap);
+        found += heap.size();
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    // Keep the lookups observable so they are not optimized away.
+    volatile size_t sink = found;
+    (void)sink;
+    return ns / points.size();
 }
 void processInputCPU(GLFWwindow *window, float deltaTime,
                      bool &cameraMoving, bool &savePPMRequested)
@@ -520,4 +1220,52 @@ void processInputCPU(GLFWwindow *window, float deltaTime,
     if (glfwGetKey(window, GLFW_KEY_T) == GLFW_RELEASE) {
         tPressed = false;
     }
+
+    // ------------ BUCKETED GATHER ON/OFF ------------
+    static bool bPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS && !bPressed) {
+        bucketedGather = !bucketedGather;
+        std::cout << "Photon gather: " << (bucketedGather ? "bucketed SoA" : "kd-tree") << std::endl;
+        cameraMoving = true;
+        bPressed = true;
+    }
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_RELEASE) {
+        bPressed = false;
+    }
+
+    // ------------ IRRADIANCE PHOTONS ON/OFF ------------
+    static bool iPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_I) == GLFW_PRESS && !iPressed) {
+        irradianceGather = !irradianceGather;
+        std::cout << "Indirect lookup: " << (irradianceGather ? "irradiance photons" : "full gather") << std::endl;
+        cameraMoving = true;
+        iPressed = true;
+    }
+    if (glfwGetKey(window, GLFW_KEY_I) == GLFW_RELEASE) {
+        iPressed = false;
+    }
+
+    // ------------ VAN EMDE BOAS LAYOUT ON/OFF ------------
+    static bool vPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS && !vPressed) {
+        vebGather = !vebGather;
+        std::cout << "Photon tree layout: " << (vebGather ? "van Emde Boas" : "heap order") << std::endl;
+        cameraMoving = true;
+        vPressed = true;
+    }
+    if (glfwGetKey(window, GLFW_KEY_V) == GLFW_RELEASE) {
+        vPressed = false;
+    }
+
+    // ------------ FIXED-RADIUS GATHER ON/OFF ------------
+    static bool rPressed = false;
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS && !rPressed) {
+        rangeGather = !rangeGather;
+        std::cout << "Photon gather radius: " << (rangeGather ? "fixed" : "k-nearest") << std::endl;
+        cameraMoving = true;
+        rPressed = true;
+    }
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_RELEASE) {
+        rPressed = false;
+    }
 }
@@ -0,0 +1,163 @@
+#include "renderer/sampler.h"
+#include <cmath>
+
+bool parseSamplerType(const std::string &name, SamplerType &type)
+{
+    if (name == "random")
+    {
+        type = SamplerType::Random;
+        return true;
+    }
+    if (name == "halton")
+    {
+        type = SamplerType::Halton;
+        return true;
+    }
+    if (name == "sobol")
+    {
+        type = SamplerType::Sobol;
+        return true;
+    }
+    return false;
+}
+
+const char *samplerTypeName(SamplerType type)
+{
+    switch (type)
+    {
+    case SamplerType::Halton:
+        return "halton";
+    case SamplerType::Sobol:
+        return "sobol";
+    default:
+        return "random";
+    }
+}
+
+uint64_t scrambleKey(uint64_t key, uint64_t set)
+{
+    // SplitMix64 finalizer over both.
+    uint64_t z = key ^ (set * 0x9E3779B97F4A7C15ull + 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z = z ^ (z >> 31);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+namespace
+{
+const int HALTON_PRIMES[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31,
+                             37, 41, 43, 47, 53, 59, 61, 67, 71, 73};
+
+// Joe and Kuo's new-joe-kuo-6.21201 entries for dimensions 2 to 21: degree s
+// of the primitive polynomial, its inner coefficients a, and the initial
+// direction numbers m_1 .. m_s.
+struct SobolPolynomial
+{
+    int s;
+    uint32_t a;
+    uint32_t m[7];
+};
+
+const SobolPolynomial SOBOL_POLYNOMIALS[] = {
+    {1, 0, {1}},
+    {2, 1, {1, 3}},
+    {3, 1, {1, 3, 1}},
+    {3, 2, {1, 1, 1}},
+    {4, 1, {1, 1, 3, 3}},
+    {4, 4, {1, 3, 5, 13}},
+    {5, 2, {1, 1, 5, 5, 17}},
+    {5, 4, {1, 1, 5, 5, 5}},
+    {5, 7, {1, 1, 7, 11, 19}},
+    {5, 11, {1, 1, 5, 1, 1}},
+    {5, 13, {1, 1, 1, 3, 11}},
+    {5, 14, {1, 3, 5, 5, 31}},
+    {6, 1, {1, 3, 3, 9, 7, 49}},
+    {6, 13, {1, 1, 1, 15, 21, 21}},
+    {6, 16, {1, 3, 1, 13, 27, 49}},
+    {6, 19, {1, 1, 1, 15, 7, 5}},
+    {6, 22, {1, 3, 1, 15, 13, 25}},
+    {6, 25, {1, 1, 5, 5, 19, 61}},
+    {7, 1, {1, 3, 7, 11, 23, 15, 103}},
+    {7, 4, {1, 3, 7, 13, 13, 15, 69}},
+};
+}
+
+int HaltonSequence::dimensions() const
+{
+    return sizeof(HALTON_PRIMES) / sizeof(HALTON_PRIMES[0]);
+}
+
+uint32_t HaltonSequence::sample(uint32_t index, int dimension, uint64_t scramble) const
+{
+    const int base = HALTON_PRIMES[dimension];
+    const uint64_t key = scrambleKey(scramble, dimension);
+    const double invBase = 1.0 / base;
+
+    // Leading zero digits are shifted too, down to 32-bit precision.
+    double value = 0.0;
+    double factor = invBase;
+    for (int k = 0; factor > 0x1p-33; k++)
+    {
+        int digit = (int)(index % base);
+        index /= base;
+        int shift = (int)(scrambleKey(key, k) % base);
+        value += ((digit + shift) % base) * factor;
+        factor *= invBase;
+    }
+    return (uint32_t)std::min(value * 0x1p32, 4294967295.0);
+}
+
+SobolSequence::SobolSequence()
+{
+    for (int bit = 0; bit < 32; bit++)
+        directions[0][bit] = 1u << (31 - bit);
+
+    for (int d = 1; d < DIMENSIONS; d++)
+    {
+        const SobolPolynomial &p = SOBOL_POLYNOMIALS[d - 1];
+        uint32_t *v = directions[d];
+        for (int i = 0; i < 32; i++)
+        {
+            if (i < p.s)
+            {
+                v[i] = p.m[i] << (31 - i);
+                continue;
+            }
+            v[i] = v[i - p.s] ^ (v[i - p.s] >> p.s);
+            for (int k = 1; k < p.s; k++)
+            {
+                if ((p.a >> (p.s - 1 - k)) & 1)
+                    v[i] ^= v[i - k];
+            }
+        }
+    }
+}
+
+uint32_t SobolSequence::sample(uint32_t index, int dimension, uint64_t scramble) const
+{
+    uint32_t x = 0;
+    for (int bit = 0; index; bit++, index >>= 1)
+    {
+        if (index & 1)
+            x ^= directions[dimension][bit];
+    }
+    return x ^ (uint32_t)scrambleKey(scramble, dimension);
+}
+
+const SampleSequence *sampleSequence(SamplerType type)
+{
+    static const HaltonSequence halton;
+    static const SobolSequence sobol;
+    switch (type)
+    {
+    case SamplerType::Halton:
+        return &halton;
+    case SamplerType::Sobol:
+        return &sobol;
+    default:
+        return nullptr;
+    }
+}
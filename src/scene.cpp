@@ -1,4 +1,5 @@
 #include "renderer/scene.h"
+#include "renderer/render_cost.h"
 #include <cmath>
 #include <algorithm>
 
@@ -7,6 +8,20 @@ Texture backWallTexture;
 Texture ceilingTexture;
 bool texturesEnabled = true;
 
+// Indexed by ScenePrimitive.
+static const ScenePlane scenePlanes[SCENE_PLANE_COUNT] = {
+    {1, 0.0f, 0, 2, 1.0f, 0, 552.8f, 0, 559.2f, 0, 0},     // floor
+    {1, 548.8f, 0, 2, -1.0f, 0, 552.8f, 0, 559.2f, 0, 2},  // ceiling
+    {2, 559.2f, 0, 1, -1.0f, 0, 552.8f, 0, 548.8f, 0, 1},  // back wall
+    {0, 552.8f, 2, 1, -1.0f, 0, 559.2f, 0, 548.8f, 3, -1}, // red wall
+    {0, 0.0f, 2, 1, 1.0f, 0, 559.2f, 0, 548.8f, 4, -1},    // green wall
+};
+
+static const SceneSphere sceneSpheres[SCENE_SPHERE_COUNT] = {
+    {Vec3(185, 80, 169), 80.0f, 1, PRIM_GLASS_SPHERE},
+    {Vec3(368, 80, 351), 80.0f, 2, PRIM_MIRROR_SPHERE},
+};
+
 Vec3 getMaterialColor(int mat, float u, float v, int textureId) {
     if (texturesEnabled) {
         if (textureId == 0 && floorTexture.loaded) {
@@ -34,7 +49,8 @@ float getMaterialAlpha(int mat) {
     return 1.0f;
 }
 
-bool intersectSphere(Vec3 ro, Vec3 rd, Vec3 center, float radius, Hit &hit, int mat) {
+bool intersectSphere(Vec3 ro, Vec3 rd, Vec3 center, float radius, Hit &hit, int mat,
+                     int primitive) {
     Vec3 oc = ro - center;
     float a = rd.dot(rd);
     float b = oc.dot(rd);
@@ -51,6 +67,7 @@ bool intersectSphere(Vec3 ro, Vec3 rd, Vec3 center, float radius, Hit &hit, int
     hit.normal = (hit.point - center).normalize();
     hit.material = mat;
     hit.textureId = -1;
+    hit.primitive = primitive;
     
     Vec3 localP = (hit.point - center).normalize();
     hit.u = 0.5f + atan2(localP.z, localP.x) / (2.0f * PI);
@@ -61,7 +78,7 @@ bool intersectSphere(Vec3 ro, Vec3 rd, Vec3 center, float radius, Hit &hit, int
 
 bool intersectPlane(Vec3 ro, Vec3 rd, Vec3 p0, Vec3 normal,
                     float minA, float maxA, float minB, float maxB,
-                    Hit &hit, int mat, int texId) {
+                    Hit &hit, int mat, int texId, int primitive) {
     float denom = normal.dot(rd);
     if (std::abs(denom) < 0.0001f) return false;
 
@@ -96,32 +113,44 @@ bool intersectPlane(Vec3 ro, Vec3 rd, Vec3 p0, Vec3 normal,
     hit.u = u;
     hit.v = v;
     hit.textureId = texId;
+    hit.primitive = primitive;
     return true;
 }
 
 bool intersectScene(Vec3 ro, Vec3 rd, Hit &hit, bool includeLight) {
+    if (activePixelCost)
+        activePixelCost->intersections++;
     bool hitAny = false;
 
-    if (intersectPlane(ro, rd, Vec3(0, 0, 0), Vec3(0, 1, 0), 0, 552.8f, 0, 559.2f, hit, 0, 0))
-        hitAny = true;
-    if (intersectPlane(ro, rd, Vec3(0, 548.8f, 0), Vec3(0, -1, 0), 0, 552.8f, 0, 559.2f, hit, 0, 2))
-        hitAny = true;
-    if (intersectPlane(ro, rd, Vec3(0, 0, 559.2f), Vec3(0, 0, -1), 0, 552.8f, 0, 548.8f, hit, 0, 1))
-        hitAny = true;
-    if (intersectPlane(ro, rd, Vec3(552.8f, 0, 0), Vec3(-1, 0, 0), 0, 559.2f, 0, 548.8f, hit, 3, -1))
-        hitAny = true;
-    if (intersectPlane(ro, rd, Vec3(0, 0, 0), Vec3(1, 0, 0), 0, 559.2f, 0, 548.8f, hit, 4, -1))
-        hitAny = true;
+    for (int i = 0; i < SCENE_PLANE_COUNT; i++) {
+        const ScenePlane &p = scenePlanes[i];
+        Vec3 p0, normal;
+        if (p.axis == 0) { p0.x = p.offset; normal.x = p.normalSign; }
+        if (p.axis == 1) { p0.y = p.offset; normal.y = p.normalSign; }
+        if (p.axis == 2) { p0.z = p.offset; normal.z = p.normalSign; }
+        if (intersectPlane(ro, rd, p0, normal, p.minU, p.maxU, p.minV, p.maxV, hit, p.material,
+                           p.textureId, i))
+            hitAny = true;
+    }
 
     if (includeLight) {
-        if (intersectPlane(ro, rd, Vec3(278, 548.7f, 279.5f), Vec3(0, -1, 0), 213, 343, 227, 332, hit, 5, -1))
+        if (intersectPlane(ro, rd, Vec3(278, 548.7f, 279.5f), Vec3(0, -1, 0), 213, 343, 227, 332, hit, 5, -1, PRIM_LIGHT))
             hitAny = true;
     }
 
-    if (intersectSphere(ro, rd, Vec3(185, 80, 169), 80.0f, hit, 1))
-        hitAny = true;
-    if (intersectSphere(ro, rd, Vec3(368, 80, 351), 80.0f, hit, 2))
-        hitAny = true;
+    for (int i = 0; i < SCENE_SPHERE_COUNT; i++) {
+        const SceneSphere &s = sceneSpheres[i];
+        if (intersectSphere(ro, rd, s.center, s.radius, hit, s.material, s.primitive))
+            hitAny = true;
+    }
 
     return hitAny;
-}
\ No newline at end of file
+}
+
+ScenePlane scenePlane(int primitive) {
+    return scenePlanes[primitive];
+}
+
+const SceneSphere &sceneSphere(int index) {
+    return sceneSpheres[index];
+}